@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Benchmark suite for the simulator and the protocols.
+#
+# Runs the micro benchmarks of the simulator core, then every protocol over
+# a grid of scenarios, and prints one JSON object per line on stdout.
+# The grid can be narrowed with the variables below, e.g.
+#   MSGS=10000 WINDOWS=10 ./bench/bench.sh > results.jsonl
+#
+
+PROTOCOLS=${PROTOCOLS:-"abt gbn sr"}
+MSGS=${MSGS:-"100000 1000000"}
+WINDOWS=${WINDOWS:-"10 100 1000"}
+LOSSES=${LOSSES:-"0 0.2 0.5"}
+CORRUPTION=${CORRUPTION:-0}
+INTERVAL=${INTERVAL:-50}
+SEED=${SEED:-1}
+TIMEOUT=${TIMEOUT:-600}
+
+cd "$(dirname "$0")/.." || exit 1
+
+version=$(git describe --always --dirty 2>/dev/null || echo unknown)
+metrics=$(mktemp)
+trap 'rm -f "$metrics"' EXIT
+
+echo "{\"bench\":\"version\",\"version\":\"$version\",\"date\":\"$(date -u +%Y-%m-%dT%H:%M:%SZ)\"}"
+
+./bench/microbench "$SEED"
+
+for p in $PROTOCOLS; do
+    # the alternating bit protocol has no window
+    windows=$WINDOWS
+    [ "$p" = abt ] && windows=1
+
+    for m in $MSGS; do
+        for w in $windows; do
+            for l in $LOSSES; do
+                scenario="\"protocol\":\"$p\",\"messages\":$m,\"window\":$w,\"loss\":$l,\"corruption\":$CORRUPTION,\"interval\":$INTERVAL,\"seed\":$SEED"
+                rm -f "$metrics"
+                timeout "$TIMEOUT" ./$p -s "$SEED" -w "$w" -m "$m" -l "$l" -c "$CORRUPTION" \
+                    -t "$INTERVAL" -v 0 --metrics="$metrics" > /dev/null 2>&1
+                status=$?
+                if [ $status -eq 0 ] && [ -s "$metrics" ]; then
+                    echo "{\"bench\":\"run\",$scenario,\"result\":$(cat "$metrics")}"
+                elif [ $status -eq 124 ]; then
+                    echo "{\"bench\":\"run\",$scenario,\"status\":\"timeout\",\"timeout\":$TIMEOUT}"
+                else
+                    echo "{\"bench\":\"run\",$scenario,\"status\":\"failed\",\"exit\":$status}"
+                fi
+            done
+        done
+    done
+done
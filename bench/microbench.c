@@ -0,0 +1,166 @@
+#include "../include/simulator.h"
+#include "../include/event.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+* Micro benchmarks of the simulator core.
+* Links against the simulator without its main() and with no-op protocol
+* entities, and prints one JSON object per measurement:
+*   - insertevent: hold model (remove the earliest event, reschedule it)
+*     at a fixed event list depth
+*   - tolayer3: a window burst of packets handed to an empty medium
+*   - tolayer3_batch: the same burst in one call
+*/
+
+extern int TRACE;
+extern float lossprob;
+extern float corruptprob;
+
+void init(int seed);
+float jimsrand();
+
+/* no-op protocol entities */
+void A_output(struct msg message) {}
+void A_input(struct pkt packet) {}
+void A_timerinterrupt() {}
+void A_init() {}
+void B_input(struct pkt packet) {}
+void B_init() {}
+
+void get_proto_stats(struct proto_stats *stats) {
+    memset(stats, 0, sizeof(struct proto_stats));
+}
+
+void proto_save() {}
+void proto_restore() {}
+
+PROTOCOL(noop);
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+* Function to free every event left on the event list
+*/
+static void drain() {
+    while (evq->nevents > 0) {
+        freeevent(removeevent());
+    }
+}
+
+/**
+* Function to time removing and reinserting events at a fixed list depth
+*
+* @param depth number of events on the list
+*/
+static void bench_insertevent(int depth) {
+    long ops = 20000000L / depth;
+    double start, elapsed;
+
+    if (ops < 10000) {
+        ops = 10000;
+    }
+    drain();
+    for (int i = 0; i < depth; ++i) {
+        struct event *p = newevent();
+        p->evtime = SIM_TICKS(10.0 * depth * jimsrand());
+        p->evtype = TIMER_INTERRUPT;
+        p->eventity = A;
+        p->flow = 0;
+        p->pktptr = NULL;
+        p->timerid = -1;
+        insertevent(p);
+    }
+
+    start = now_ns();
+    for (long i = 0; i < ops; ++i) {
+        struct event *p = removeevent();
+        p->evtime += SIM_TICKS(10.0 * depth * jimsrand());
+        insertevent(p);
+    }
+    elapsed = now_ns() - start;
+
+    printf("{\"bench\":\"insertevent\",\"depth\":%d,\"ops\":%ld,\"ns_per_op\":%f}\n",
+           depth, ops, elapsed / ops);
+    drain();
+}
+
+/**
+* Function to time tolayer3 for bursts of packets
+*
+* @param burst packets handed to layer 3 before the medium is drained
+*/
+static void bench_tolayer3(int burst) {
+    long rounds = 2000000L / burst;
+    double elapsed = 0.0, start;
+    struct pkt packet;
+
+    memset(&packet, 0, sizeof(struct pkt));
+    drain();
+    for (long r = 0; r < rounds; ++r) {
+        start = now_ns();
+        for (int i = 0; i < burst; ++i) {
+            packet.seqnum = i;
+            tolayer3(A, packet);
+        }
+        elapsed += now_ns() - start;
+        drain();
+    }
+
+    printf("{\"bench\":\"tolayer3\",\"burst\":%d,\"ops\":%ld,\"ns_per_op\":%f}\n",
+           burst, rounds * burst, elapsed / (rounds * burst));
+}
+
+/**
+* Function to time tolayer3_batch for bursts of packets
+*
+* @param burst packets handed to layer 3 in one call
+*/
+static void bench_tolayer3_batch(int burst) {
+    long rounds = 2000000L / burst;
+    double elapsed = 0.0, start;
+    struct pkt *pkts = calloc(burst, sizeof(struct pkt));
+
+    for (int i = 0; i < burst; ++i) {
+        pkts[i].seqnum = i;
+    }
+    drain();
+    for (long r = 0; r < rounds; ++r) {
+        start = now_ns();
+        tolayer3_batch(A, pkts, burst);
+        elapsed += now_ns() - start;
+        drain();
+    }
+    free(pkts);
+
+    printf("{\"bench\":\"tolayer3_batch\",\"burst\":%d,\"ops\":%ld,\"ns_per_op\":%f}\n",
+           burst, rounds * burst, elapsed / (rounds * burst));
+}
+
+int main(int argc, char **argv)
+{
+    static const int depths[] = {10, 100, 1000, 10000};
+    static const int bursts[] = {10, 100, 1000};
+
+    TRACE = 0;
+    lossprob = 0.0;
+    corruptprob = 0.0;
+    init(argc > 1 ? atoi(argv[1]) : 1);
+
+    for (int i = 0; i < sizeof(depths) / sizeof(depths[0]); ++i) {
+        bench_insertevent(depths[i]);
+    }
+    for (int i = 0; i < sizeof(bursts) / sizeof(bursts[0]); ++i) {
+        bench_tolayer3(bursts[i]);
+    }
+    for (int i = 0; i < sizeof(bursts) / sizeof(bursts[0]); ++i) {
+        bench_tolayer3_batch(bursts[i]);
+    }
+    return 0;
+}
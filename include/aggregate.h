@@ -0,0 +1,17 @@
+#ifndef AGGREGATE_H_
+#define AGGREGATE_H_
+
+#include "simulator.h"
+
+/* Messages held at A, and packets sent in frames of several, with --aggregate */
+extern int agg_max;
+extern float agg_delay;
+
+void agg_init(int max, float delay, int nflows);
+int agg_hold(int flow, const struct msg *message, sim_ticks_t now);
+int agg_due(int flow, sim_ticks_t now);
+int agg_take(int flow, struct msg *message, sim_ticks_t now);
+void agg_framed(int first);
+void agg_printstats();
+
+#endif
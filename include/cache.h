@@ -0,0 +1,34 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "simulator.h"
+
+/* A cached run is one file, named after its key, made of this header,
+   the configuration it was run with, its report and its --metrics line,
+   so it can be mapped and used in place */
+#define CACHE_MAGIC "TLSCACH1"
+
+struct cache_record {
+   char magic[8];
+   uint64_t key;           /* FNV-1a of the configuration */
+   uint32_t configlen;     /* bytes of each part after the header */
+   uint32_t textlen;
+   uint32_t metricslen;
+   int32_t a_application;  /* the [PA2] counters of the run */
+   int32_t a_transport;
+   int32_t b_transport;
+   int32_t b_application;
+   double time;            /* simulated time at the end */
+};
+
+/* Results of earlier runs with the same configuration and build */
+int cache_open(const char *dir, int refresh, const char *options);
+int cache_fetch(const struct proto_ops *protocol, char **metricsline);
+void cache_begin();
+void cache_metrics(const char *line);
+void cache_end(int ok);
+
+#endif
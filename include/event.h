@@ -0,0 +1,98 @@
+#ifndef EVENT_H_
+#define EVENT_H_
+
+#include "simulator.h"
+
+/* Simulator internals shared by the emulator modules (not for students) */
+
+struct event {
+   sim_ticks_t evtime;     /* event time */
+   int evtype;             /* event type code */
+   int eventity;           /* entity where event occurs */
+   int flow;               /* flow the entity belongs to */
+   struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
+   struct pkt pkt;         /* the packet pktptr points to */
+   struct event *nextfree; /* link in the pool of free events */
+   long long seq;          /* scheduling order within the flow */
+   int heapidx;            /* position in the event heap */
+   int timerid;            /* id of a named timer, -1 for starttimer() */
+   int fecgroup;           /* FEC group of a packet, -1 if not coded */
+   int fecindex;           /* its index in the group, or minus its size for
+                              the parity */
+   int inframe;            /* a packet following the last one in its frame */
+   int extra;              /* an arrival of the saturated source, which
+                              sets up no next one */
+ };
+
+/* possible events: */
+#define  TIMER_INTERRUPT 0  
+#define  FROM_LAYER5     1
+#define  FROM_LAYER3     2
+#define  FEC_TIMEOUT     3  /* a group of A's packets is to close, see fec.c */
+#define  AGG_TIMEOUT     4  /* messages held at A are due, see aggregate.c */
+
+#define   A    0
+#define   B    1
+
+/* pending events, a binary heap ordered by time, then flow, then the
+   latest scheduled first (as the sorted event list always did) */
+struct evqueue {
+   struct event **heap;
+   int nevents;            /* events on the heap */
+   int size;               /* entries allocated */
+   int ninflight[2];       /* packets in the medium, per receiving entity */
+   struct event *pool;     /* freed events, reused by newevent() */
+ };
+
+/* a sender/receiver pair.  With more than one flow each has random streams
+   of its own, so its arrivals and the fate of its packets do not depend on
+   how the events of the other flows interleave with its own */
+struct flow {
+   int nsim;                   /* messages from layer 5 so far */
+   int done;                   /* got its nsimmax msgs and has stopped */
+   sim_ticks_t stoptime;       /* time it stopped */
+   sim_ticks_t lastarrival[2]; /* latest in-order arrival per entity */
+   struct event *timers[2];    /* pending timer interrupt per entity */
+   struct event **idtimers[2]; /* pending named timers per entity, by id */
+   int nidtimers[2];           /* ids there is room for */
+   long long nextseq;          /* events scheduled so far */
+   unsigned long long rng[2];  /* streams for simrand() */
+   double onleft;              /* time left in the on period, see traffic.c */
+   int traceidx;               /* next gap of the arrival trace */
+   int nextdelivery;           /* lowest message B may deliver next */
+   int nskipped;               /* messages B went past without delivering */
+ };
+
+/* random streams of a flow */
+#define RNG_ARRIVALS 0         /* message arrivals */
+#define RNG_MEDIUM   1         /* link and medium decisions */
+
+/* the queue, time and flow a thread is simulating; worker threads of a
+   parallel run (see parallel.h) have their own */
+extern __thread struct evqueue *evq;
+extern __thread sim_ticks_t simtime;
+extern __thread int curflow;
+
+extern struct evqueue mainq;
+extern struct flow *flows;
+extern int nflows;
+extern int nsimmax;
+
+float simrand(int stream);
+
+struct event *newevent();
+void freeevent(struct event *p);
+void insertevent(struct event *p);
+void heapinsert(struct event *p);
+void heapreserve(int n);
+struct event *removeevent();
+struct event *nextevent();
+
+/* event handling, and the parts of it with effects outside the flow */
+int handleevent(struct event *e);
+void accountevent(int evtype, int AorB, int id);
+void sendpacket(int AorB, const struct pkt *packet, long long seq);
+int impairpacket(int AorB, const struct pkt *packet, struct pkt *copy);
+void deliverdata(int AorB, char data[]);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef FEC_H_
+#define FEC_H_
+
+#include "simulator.h"
+
+/* XOR parity over groups of the packets A sends, with --fec */
+extern int fec_k;
+extern float fec_wait;
+
+void fec_init(int k, float wait, int nflows);
+int fec_encode(int flow, const struct pkt *packet, int *group, int *index, struct pkt *parity);
+int fec_close(int flow, int group, struct pkt *parity);
+void fec_lost(int flow, int group, int index);
+int fec_receive(int flow, int group, int index, const struct pkt *packet,
+                void (*deliver)(struct pkt *packet, int rebuilt));
+void fec_printstats(int ndelivered, double time);
+
+#endif
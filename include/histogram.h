@@ -0,0 +1,27 @@
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stdint.h>
+
+/* log-linear histogram: values below 2^HIST_SUB_BITS are counted exactly,
+   larger ones in 2^HIST_SUB_BITS buckets per power of two, so a reported
+   percentile is within 1/2^HIST_SUB_BITS of the recorded value */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct histogram {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_init(struct histogram *h);
+void hist_record(struct histogram *h, uint64_t value);
+void hist_merge(struct histogram *into, const struct histogram *from);
+uint64_t hist_percentile(const struct histogram *h, double percentile);
+double hist_mean(const struct histogram *h);
+
+#endif
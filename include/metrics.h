@@ -0,0 +1,20 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdio.h>
+
+#include "simulator.h"
+
+/* Per-run metrics collected by the simulator */
+void metrics_init(int nmsgs, int flowcount);
+void metrics_tag(struct msg *message, int id);
+int metrics_id(const char *data);
+void metrics_created(int id, sim_ticks_t now);
+void metrics_sent(int AorB, const struct pkt *packet);
+void metrics_delivered(int AorB, char data[], sim_ticks_t now);
+void metrics_timeout();
+void metrics_totals(int *delivered, double *latency_sum);
+void metrics_write(FILE *fp, const char *protocol, sim_ticks_t now);
+void metrics_print_flows(sim_ticks_t now);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include "simulator.h"
+
+/* Conservative parallel simulation of the flows on worker threads */
+int parallel_run(int nthreads);
+int parallel_defer_event(int evtype, int AorB, int id);
+int parallel_defer_packets(int AorB, const struct pkt *pkts, int n, long long seq);
+int parallel_defer_data(int AorB, char data[]);
+
+#endif
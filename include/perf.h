@@ -0,0 +1,24 @@
+#ifndef PERF_H_
+#define PERF_H_
+
+/* Hardware counters of a run, split by the phase of the simulation that
+   was running, with --perf.  PERF_ENTER switches to a phase and PERF_LEAVE
+   goes back to the one before; both are a test of perf_active otherwise */
+enum perf_phase {
+   PERF_SIMULATOR,      /* everything else the simulator does */
+   PERF_DEQUEUE,        /* taking events off the event list */
+   PERF_TOLAYER3,       /* the medium and the link, from tolayer3() */
+   PERF_CALLBACKS,      /* the protocol */
+   PERF_NPHASES
+};
+
+extern int perf_active;
+
+int perf_open();
+int perf_switch(int phase);
+void perf_report(long nevents);
+
+#define PERF_ENTER(var, phase) int var = perf_active ? perf_switch(phase) : 0
+#define PERF_LEAVE(var) do { if (perf_active) perf_switch(var); } while (0)
+
+#endif
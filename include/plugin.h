@@ -0,0 +1,9 @@
+#ifndef PLUGIN_H_
+#define PLUGIN_H_
+
+#include "simulator.h"
+
+/* Protocols built as shared objects and loaded at run time */
+const struct proto_ops *plugin_load(const char *path);
+
+#endif
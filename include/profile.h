@@ -0,0 +1,34 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+
+/* Latency histograms of the calls into the protocol and the simulator
+   core, built with make PROFILE=1 (-DSIM_PROFILE); otherwise the
+   PROFILE_ macros compile to nothing */
+enum profile_site {
+   PROF_A_OUTPUT,
+   PROF_A_INPUT,
+   PROF_A_TIMER,
+   PROF_B_INPUT,
+   PROF_INSERTEVENT,
+   PROF_TOLAYER3,
+   PROF_TOLAYER3_BATCH,
+   PROF_NSITES
+};
+
+#ifdef SIM_PROFILE
+uint64_t profile_now();
+void profile_record(int site, uint64_t start);
+void profile_report();
+
+#define PROFILE_BEGIN(var) uint64_t var = profile_now()
+#define PROFILE_END(site, var) profile_record(site, var)
+#define PROFILE_REPORT() profile_report()
+#else
+#define PROFILE_BEGIN(var)
+#define PROFILE_END(site, var)
+#define PROFILE_REPORT()
+#endif
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef REALTIME_H_
+#define REALTIME_H_
+
+#include "simulator.h"
+
+/* The simulation paced by the wall clock, optionally fed messages from input */
+int realtime_input(const char *filename);
+int realtime_run(double timeunit);
+void realtime_printstats(int ndelivered);
+
+#endif
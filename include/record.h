@@ -0,0 +1,29 @@
+#ifndef RECORD_H_
+#define RECORD_H_
+
+/* what the medium does to one packet */
+#define CORRUPT_NONE    0
+#define CORRUPT_PAYLOAD 1
+#define CORRUPT_SEQNUM  2
+#define CORRUPT_ACKNUM  3
+
+struct chan_decision {
+   int lost;          /* packet never arrives */
+   int reordered;     /* packet skips the in-order constraint */
+   int corrupt;       /* one of CORRUPT_* */
+   float delay;       /* time units added to the arrival base */
+};
+
+/* Record and replay of channel decisions and message arrival gaps */
+int record_open(const char *filename);
+int replay_open(const char *filename);
+void replay_rewind();
+int replay_packet(int AorB, struct chan_decision *d);
+void record_packet(int AorB, const struct chan_decision *d);
+int replay_arrival(double *gap);
+void record_arrival(double gap);
+int record_active();
+int replay_active();
+void record_close();
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef REPLICATE_H_
+#define REPLICATE_H_
+
+#include "simulator.h"
+
+/* what a run measured, for the confidence intervals */
+struct replicate_result {
+   double throughput;   /* messages delivered per time unit */
+   double latency;      /* mean delivery latency in time units, < 0 if none */
+};
+
+/* Independent replications, each a forked process running run(index) */
+typedef int (*replicate_fn)(int index, struct replicate_result *result);
+int replicate_run(replicate_fn run, int maxruns, int jobs, double precision);
+
+/* Batch means within one run, in batches of length time units */
+void batch_open(double length, double precision);
+int batch_advance(sim_ticks_t now);
+void batch_report();
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef RING_H_
+#define RING_H_
+
+#include "simulator.h"
+
+/* The protocols run on two threads that pass packets through shared memory */
+int ring_run(double timeunit);
+int ring_send(int AorB, const struct pkt *pkts, int n);
+void ring_printstats(int ndelivered);
+
+#endif
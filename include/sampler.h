@@ -0,0 +1,11 @@
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+#include "simulator.h"
+
+/* Periodic CSV samples of the simulator state */
+int sampler_open(const char *filename, double interval);
+void sampler_advance(sim_ticks_t now);
+void sampler_close(sim_ticks_t now);
+
+#endif
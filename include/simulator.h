@@ -1,8 +1,16 @@
 #ifndef SIMULATOR_H_
 #define SIMULATOR_H_
 
+#include <stddef.h>
+
 #define BIDIRECTIONAL 0
 
+/* simulated time is kept in integer ticks, TICKS_PER_UNIT to a time unit */
+typedef long long sim_ticks_t;
+#define TICKS_PER_UNIT 1000000
+#define SIM_TICKS(t) ((sim_ticks_t)((t) * TICKS_PER_UNIT + 0.5))
+#define SIM_UNITS(ticks) ((double)(ticks) / TICKS_PER_UNIT)
+
 /* a "msg" is the data unit passed from layer 5 (teachers code) to layer  */
 /* 4 (students' code).  It contains the data (characters) to be delivered */
 /* to layer 5 via the students transport level protocol entities.         */
@@ -20,21 +28,90 @@ struct pkt {
    char payload[20];
 };
 
+/* snapshot of a protocol's window state, reported to the simulator */
+struct proto_stats {
+   int snd_base;     /* oldest unacknowledged seqnum at A */
+   int snd_next;     /* snd_base plus the packets outstanding, which may
+                        pass the end of the sequence space */
+   int snd_unsent;   /* messages waiting at A for room in the window */
+   int snd_window;   /* most seqnums A keeps outstanding */
+   int rcv_buffered; /* packets held at B for in-order delivery */
+};
+
 /* Implementation framework interface */
 void A_output(struct msg message);
 void A_input(struct pkt packet);
 void A_timerinterrupt();
+void A_timerinterrupt_id(int id);   /* only with named timers, see below */
 void A_init();
 
 void B_input(struct pkt packet);
 void B_init();
 
-/* Simulator API */
-void starttimer(int AorB, float increment);
+void get_proto_stats(struct proto_stats *stats);
+
+/* save and restore all protocol state for simulator snapshots, using
+   snapshot_write() / snapshot_read() in the same order */
+void proto_save();
+void proto_restore();
+
+/* the interface above as a table, so the simulator can also run protocols
+   built as shared objects and loaded at run time (see plugin.h) */
+struct proto_ops {
+   const char *name;
+   void (*A_output)(struct msg message);
+   void (*A_input)(struct pkt packet);
+   void (*A_timerinterrupt)();
+   void (*A_init)();
+   void (*B_input)(struct pkt packet);
+   void (*B_init)();
+   void (*get_stats)(struct proto_stats *stats);
+   void (*save)();
+   void (*restore)();
+   void (*A_timerinterrupt_id)(int id);
+   int drops;          /* 1 if B may never deliver some messages, as ABT */
+};
+
+/* every protocol exports its table as proto_ops, with PROTOCOL(name); at
+   the end of its source file, or PROTOCOL_NAMED_TIMERS(name); if it uses
+   starttimer_id().  The simulator keeps a slot for every id up to the
+   largest used, so ids should be small, e.g. a slot of the window.  A
+   protocol that gives up on messages ends with PROTOCOL_DROPPING(name);
+   instead, for the delivery check to allow the gaps it leaves */
+#define PROTOCOL(protoname) \
+   const struct proto_ops proto_ops = { #protoname, A_output, A_input, \
+      A_timerinterrupt, A_init, B_input, B_init, get_proto_stats, \
+      proto_save, proto_restore, NULL, 0 }
+#define PROTOCOL_NAMED_TIMERS(protoname) \
+   const struct proto_ops proto_ops = { #protoname, A_output, A_input, \
+      A_timerinterrupt, A_init, B_input, B_init, get_proto_stats, \
+      proto_save, proto_restore, A_timerinterrupt_id, 0 }
+#define PROTOCOL_DROPPING(protoname) \
+   const struct proto_ops proto_ops = { #protoname, A_output, A_input, \
+      A_timerinterrupt, A_init, B_input, B_init, get_proto_stats, \
+      proto_save, proto_restore, NULL, 1 }
+
+/* protocol being simulated */
+extern const struct proto_ops *proto;
+
+/* Simulator API.  With several flows (--flows), the protocol callbacks
+   and these calls act on the flow given by getflow(), and a protocol keeps
+   one copy of its state per flow */
+void starttimer(int AorB, double increment);
+void starttimer_ticks(int AorB, sim_ticks_t increment);
 void stoptimer(int AorB);
+void starttimer_id(int AorB, int id, double increment);
+void stoptimer_id(int AorB, int id);
 void tolayer3(int AorB, struct pkt packet);
+void tolayer3_batch(int AorB, const struct pkt *pkts, int n);
 void tolayer5(int AorB, char datasent[]);
 int getwinsize();
-float get_sim_time();
+int getseqbits();
+int getflow();
+int getnflows();
+double get_sim_time();
+sim_ticks_t get_sim_ticks();
+void snapshot_write(const void *data, int len);
+void snapshot_read(void *data, int len);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,14 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+/* Binary snapshots of the whole simulation */
+int snapshot_save(const char *filename, const char *protocol);
+int snapshot_load(const char *filename, const char *protocol);
+
+/* per-module state, written and read back in this order */
+void sim_save();
+void sim_restore();
+void metrics_save();
+void metrics_restore();
+
+#endif
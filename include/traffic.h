@@ -0,0 +1,16 @@
+#ifndef TRAFFIC_H_
+#define TRAFFIC_H_
+
+#include <stdio.h>
+
+#include "simulator.h"
+
+/* Message arrival models and payloads of the layer 5 source */
+int traffic_open(const char *model);
+int payload_open(const char *content);
+double traffic_gap(double mean);
+int traffic_due();
+void traffic_fill(struct msg *message, int nsim, int id);
+void traffic_describe(FILE *fp);
+
+#endif
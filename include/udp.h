@@ -0,0 +1,11 @@
+#ifndef UDP_H_
+#define UDP_H_
+
+#include "simulator.h"
+
+/* The protocols run over UDP sockets on the loopback, in wall-clock time */
+int udp_run(double timeunit);
+int udp_send(int AorB, const struct pkt *pkts, int n);
+void udp_printstats(int ndelivered);
+
+#endif
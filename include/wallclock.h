@@ -0,0 +1,13 @@
+#ifndef WALLCLOCK_H_
+#define WALLCLOCK_H_
+
+#include "simulator.h"
+
+/* Simulated time on the wall clock, for --udp, --ring and --realtime */
+void wallclock_start(double timeunit);
+sim_ticks_t wallclock_now();
+void wallclock_arm(int timerfd, sim_ticks_t when);
+void wallclock_stop(double *wallsecs, double *cpusecs);
+double wallclock_threadcpu();
+
+#endif
@@ -25,20 +25,35 @@
 *
 */
 
-/* A's state variables */
-static int state_a; // 0 - 3
-static int seq_num_a;
-static struct pkt packet_a;
+/* per-flow state, one copy for each flow of the simulation */
+struct flow_state {
+    /* A's state variables */
+    int state_a; // 0 - 3
+    int seq_num_a;
+    struct pkt packet_a;
+
+    /* B's state variables */
+    int state_b;
+    struct pkt packet_b;
+};
+static struct flow_state *flows = NULL;
+static __thread struct flow_state *st;   // state of the flow being run, per thread
 
-/* B's state variables */
-static int state_b;
-static struct pkt packet_b;
+/**
+* Function to switch to the state of the flow the simulator is running
+*/
+static void select_flow() {
+    if (flows == NULL) {
+        flows = calloc(getnflows(), sizeof(struct flow_state));
+    }
+    st = &flows[getflow()];
+}
 
 /**
 * Function to move A to next state
 */
 void next_state_a() {
-    state_a = (state_a + 1) % 4;
+    st->state_a = (st->state_a + 1) % 4;
 }
 
 
@@ -76,16 +91,16 @@ static int corrupt(struct pkt *packet) {
 *
 */
 static void handle_senda_st_zero_a(struct msg *message) {
-    memset(&packet_a, 0, sizeof(struct pkt));
+    memset(&st->packet_a, 0, sizeof(struct pkt));
 
     // copy payload
-    memcpy(&packet_a.payload, message, PAYLOAD_SIZE);
+    memcpy(&st->packet_a.payload, message, PAYLOAD_SIZE);
 
     // generate checksum
-    packet_a.checksum = checksum(&packet_a);
+    st->packet_a.checksum = checksum(&st->packet_a);
 
     // pass the packet to layer 3
-    tolayer3(0, packet_a);
+    tolayer3(0, st->packet_a);
 
     // change state to 1
     next_state_a();
@@ -100,19 +115,19 @@ static void handle_senda_st_zero_a(struct msg *message) {
 *
 */
 static void handle_senda_st_two_a(struct msg *message) {
-    memset(&packet_a, 0, sizeof(struct pkt));
+    memset(&st->packet_a, 0, sizeof(struct pkt));
 
     // copy payload
-    memcpy(&packet_a.payload, message, PAYLOAD_SIZE);
+    memcpy(&st->packet_a.payload, message, PAYLOAD_SIZE);
 
     // set seq num
-    packet_a.seqnum = 1;
+    st->packet_a.seqnum = 1;
 
     // generate checksum
-    packet_a.checksum = checksum(&packet_a);
+    st->packet_a.checksum = checksum(&st->packet_a);
 
     // pass the packet to layer 3
-    tolayer3(0, packet_a);
+    tolayer3(0, st->packet_a);
 
     // change state to 1
     next_state_a();
@@ -135,7 +150,7 @@ static void handle_recv_a(struct pkt *packet, int acknum) {
 
 static void handle_timeout_a() {
     // resend the last packet
-    tolayer3(0, packet_a);
+    tolayer3(0, st->packet_a);
 
     // start the timer again
     starttimer(0, TIMEOUT);
@@ -145,7 +160,8 @@ static void handle_timeout_a() {
 void A_output(message)
   struct msg message;
 {
-    switch(state_a) {
+    select_flow();
+    switch(st->state_a) {
     case 0:
         handle_senda_st_zero_a(&message);
         break;
@@ -170,7 +186,8 @@ void A_output(message)
 void A_input(packet)
   struct pkt packet;
 {
-    switch(state_a) {
+    select_flow();
+    switch(st->state_a) {
     case 0:
         // NO OP
         break;
@@ -192,7 +209,8 @@ void A_input(packet)
 /* called when A's timer goes off */
 void A_timerinterrupt()
 {
-    switch(state_a) {
+    select_flow();
+    switch(st->state_a) {
     case 0:
         // NO OP
         break;
@@ -215,11 +233,38 @@ void A_timerinterrupt()
 /* entity A routines are called. You can use it to do any initialization */
 void A_init()
 {
-
+    select_flow();
+    st->state_a = 0;
+    st->seq_num_a = 0;
 }
 
 /* Note that with simplex transfer from a-to-B, there is no B_output() */
 
+/* report the window state to the simulator */
+void get_proto_stats(struct proto_stats *stats)
+{
+    select_flow();
+    // at most one packet is outstanding, in states 1 and 3
+    stats->snd_base = 0;
+    stats->snd_next = st->state_a % 2;
+    stats->snd_unsent = 0;
+    stats->snd_window = 1;
+    stats->rcv_buffered = 0;
+}
+
+/* save the protocol state for a simulator snapshot */
+void proto_save()
+{
+    // the state of every flow is plain data
+    snapshot_write(flows, getnflows() * sizeof(struct flow_state));
+}
+
+/* restore the protocol state from a simulator snapshot */
+void proto_restore()
+{
+    snapshot_read(flows, getnflows() * sizeof(struct flow_state));
+}
+
 /**
 * Function to send ack
 *
@@ -227,23 +272,24 @@ void A_init()
 */
 static void send_ack(int acknum) {
     // create packet
-    memset(&packet_b, 0, sizeof(struct pkt));
+    memset(&st->packet_b, 0, sizeof(struct pkt));
 
     // set the acknum
-    packet_b.acknum = acknum;
+    st->packet_b.acknum = acknum;
 
     // checksum packet
-    packet_b.checksum = checksum(&packet_b);
+    st->packet_b.checksum = checksum(&st->packet_b);
 
     // send the ACK packet
-    tolayer3(1, packet_b);
+    tolayer3(1, st->packet_b);
 }
 
 /* called from layer 3, when a packet arrives for layer 4 at B*/
 void B_input(packet)
   struct pkt packet;
 {
-    switch(state_b) {
+    select_flow();
+    switch(st->state_b) {
     case 0:
         if (!corrupt(&packet) && packet.seqnum == 0) {
             // deliver the packet
@@ -253,7 +299,7 @@ void B_input(packet)
             send_ack(0);
 
             // change state
-            state_b = 1;
+            st->state_b = 1;
         } else {
             // send duplicate ACK
             send_ack(1);
@@ -268,7 +314,7 @@ void B_input(packet)
             send_ack(1);
 
             // change state
-            state_b = 0;
+            st->state_b = 0;
         } else {
             // send duplicate ACK
             send_ack(0);
@@ -284,5 +330,9 @@ void B_input(packet)
 /* entity B routines are called. You can use it to do any initialization */
 void B_init()
 {
-
+    select_flow();
+    st->state_b = 0;
 }
+
+/* entry points for the simulator */
+PROTOCOL_DROPPING(abt);
@@ -0,0 +1,131 @@
+#include "../include/aggregate.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+* Message aggregation.
+*
+* A packet carries one 20-byte message, and there is no larger one, so
+* instead of packing messages into a packet, the medium carries a frame of
+* up to agg_max packets: they share one loss, corruption and delay
+* decision, and one slot of the in-order medium, the way a single larger
+* packet would, and come out one after the other. The packets an entity
+* sends while handling one event make up its frames, and so do those it
+* sends in answer to the packets of one frame, so the ACKs of a frame go
+* back in one as well.
+*
+* To have more to send at once, the messages from layer 5 are held at A,
+* Nagle-style, until agg_max of them are waiting or the first one has
+* waited agg_delay time units, and then given to A_output() in a row. The
+* latency of a message counts the time it was held.
+*/
+
+#define AGG_MAX 32
+
+struct held {
+    struct msg messages[AGG_MAX];
+    sim_ticks_t since[AGG_MAX];     /* when each came from layer 5 */
+    int first, count;
+};
+
+int agg_max = 0;
+float agg_delay = 0.0;
+
+static struct held *flows = NULL;
+static long nheld;                  /* messages held, and for how long */
+static double sumwait, maxwait;
+static long nframes, npackets;      /* frames on the medium, packets in them */
+
+/**
+* Function to set up aggregation for a run
+*
+* @param max messages held and packets per frame at most
+* @param delay time units a message is held at most
+* @param nflows number of flows
+*/
+void agg_init(int max, float delay, int nflows) {
+    agg_max = max;
+    agg_delay = delay;
+    free(flows);
+    flows = calloc(nflows, sizeof(struct held));
+    nheld = nframes = npackets = 0;
+    sumwait = maxwait = 0.0;
+}
+
+/**
+* Function to hold a message from layer 5 until there are enough to send
+*
+* @param flow flow of the message
+* @param message the message
+* @param now current time
+* @return number of messages held for the flow, agg_max when they are to
+*         be sent now
+*/
+int agg_hold(int flow, const struct msg *message, sim_ticks_t now) {
+    struct held *h = &flows[flow];
+    int i = (h->first + h->count) % AGG_MAX;
+
+    h->messages[i] = *message;
+    h->since[i] = now;
+    return ++h->count;
+}
+
+/**
+* Function to tell if the first message held for a flow has waited long
+* enough to be sent
+*
+* @param flow the flow
+* @param now current time
+*/
+int agg_due(int flow, sim_ticks_t now) {
+    struct held *h = &flows[flow];
+
+    return h->count > 0 && now - h->since[h->first] >= SIM_TICKS(agg_delay);
+}
+
+/**
+* Function to take the first message held for a flow
+*
+* @param flow the flow
+* @param message where to put it
+* @param now current time
+* @return 1 if there was one, 0 otherwise
+*/
+int agg_take(int flow, struct msg *message, sim_ticks_t now) {
+    struct held *h = &flows[flow];
+    double wait;
+
+    if (h->count == 0) {
+        return 0;
+    }
+    *message = h->messages[h->first];
+    wait = SIM_UNITS(now - h->since[h->first]);
+    h->first = (h->first + 1) % AGG_MAX;
+    h->count--;
+    nheld++;
+    sumwait += wait;
+    if (wait > maxwait) {
+        maxwait = wait;
+    }
+    return 1;
+}
+
+/**
+* Function to count a packet going on the medium
+*
+* @param first 1 if it starts a frame, 0 if it joins the last one
+*/
+void agg_framed(int first) {
+    nframes += first;
+    npackets++;
+}
+
+/**
+* Function to report what aggregation did in the last run
+*/
+void agg_printstats() {
+    printf(" Aggregation: %ld packets in %ld frames, %f packets per frame\n",
+           npackets, nframes, nframes > 0 ? (double)npackets / nframes : 0.0);
+    printf(" Aggregation: %ld messages held %f time units on average, %f at most\n",
+           nheld, nheld > 0 ? sumwait / nheld : 0.0, maxwait);
+}
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include "../include/cache.h"
+#include "../include/event.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+* Result cache.
+*
+* A run is keyed by its configuration: the protocol, the GNU build ids
+* of the executable and of the object the protocol comes from, the
+* options as the simulator parsed them, and the contents of a --traffic
+* trace. If a record with that key is in the
+* cache directory, its report and its --metrics line are given back
+* instead of running again. Only the report is kept, from the end of the
+* simulation on, not what was traced while it ran, so records stay small.
+* Otherwise the report of the run is captured, copied to stdout, and
+* saved as a new record, written aside and renamed into place so readers
+* never see half of one. With --refresh the run always happens and its
+* record replaces the one before.
+*/
+
+extern int A_application;
+extern int A_transport;
+extern int B_transport;
+extern int B_application;
+
+static const char *cachedir = NULL;
+static int refreshing;
+static char *args = NULL;            /* the options in the key */
+static size_t argslen;
+
+static char *config = NULL;          /* configuration of the current run */
+static size_t configlen;
+static uint64_t key;
+
+static FILE *captured = NULL;        /* stdout of the run being cached */
+static int savedfd = -1;
+static char *metricsline = NULL;     /* --metrics line of the run */
+
+/**
+* Function to hash bytes with 64-bit FNV-1a
+*
+* @param h hash so far, or the offset basis
+* @param data bytes
+* @param len number of bytes
+*/
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define FNV_BASIS 0xcbf29ce484222325ULL
+
+/**
+* Function to add text to a growing buffer
+*
+* @param buf buffer, reallocated
+* @param len its length, updated
+* @param text text to add
+*/
+static void append(char **buf, size_t *len, const char *text) {
+    size_t n = strlen(text);
+
+    *buf = realloc(*buf, *len + n + 1);
+    memcpy(*buf + *len, text, n + 1);
+    *len += n;
+}
+
+/**
+* Function to hash the contents of a file
+*
+* @return the hash, or 0 if it cannot be read
+*/
+static uint64_t hashfile(const char *filename) {
+    char buf[65536];
+    uint64_t h = FNV_BASIS;
+    ssize_t n;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        h = fnv1a(h, buf, n);
+    }
+    close(fd);
+    return h;
+}
+
+struct buildid_search {
+    uintptr_t addr;      /* an address in the object */
+    char id[2 * 64 + 1]; /* its build id in hex, empty if none */
+};
+
+/**
+* Function called by dl_iterate_phdr() on every loaded object, to read
+* the build id note of the one holding the address searched for
+*/
+static int find_buildid(struct dl_phdr_info *info, size_t size __attribute__((unused)), void *data) {
+    struct buildid_search *s = data;
+    const ElfW(Phdr) *ph;
+    int i, inside = 0;
+
+    for (i = 0; i < info->dlpi_phnum; ++i) {
+        ph = &info->dlpi_phdr[i];
+        if (ph->p_type == PT_LOAD && s->addr >= info->dlpi_addr + ph->p_vaddr &&
+            s->addr < info->dlpi_addr + ph->p_vaddr + ph->p_memsz) {
+            inside = 1;
+        }
+    }
+    if (!inside) {
+        return 0;
+    }
+    for (i = 0; i < info->dlpi_phnum; ++i) {
+        ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_NOTE) {
+            continue;
+        }
+        const char *p = (const char *)(info->dlpi_addr + ph->p_vaddr);
+        const char *end = p + ph->p_memsz;
+        while (p + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *note = (const ElfW(Nhdr) *)p;
+            const unsigned char *desc = (const unsigned char *)(p + sizeof(*note) + ((note->n_namesz + 3) & ~3));
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+                memcmp(p + sizeof(*note), "GNU", 4) == 0 && note->n_descsz <= 64) {
+                for (unsigned j = 0; j < note->n_descsz; ++j) {
+                    sprintf(s->id + 2 * j, "%02x", desc[j]);
+                }
+                return 1;
+            }
+            p = (const char *)desc + ((note->n_descsz + 3) & ~3);
+        }
+    }
+    return 1;
+}
+
+/**
+* Function to get the build id of the object some code is in
+*
+* @param addr address of the code
+* @param id where to put it in hex, empty if there is none
+*/
+static void buildid(const void *addr, char *id) {
+    struct buildid_search s;
+
+    s.addr = (uintptr_t)addr;
+    s.id[0] = '\0';
+    dl_iterate_phdr(find_buildid, &s);
+    strcpy(id, s.id);
+}
+
+static void flush_capture();
+
+/**
+* Function to set up the cache
+*
+* @param dir directory of the records, created if need be
+* @param refresh 1 to run again and replace the records found
+* @param options the options of the run that shape its report, a line
+*                each, with a trace as "traffic trace:FILE"
+* @return 0 on success, -1 on error
+*/
+int cache_open(const char *dir, int refresh, const char *options) {
+    const char *trace;
+    char hash[32];
+
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    cachedir = dir;
+    refreshing = refresh;
+    argslen = 0;
+    append(&args, &argslen, options);
+    // a trace is read from a file, which may change
+    if ((trace = strstr(options, "traffic trace:")) != NULL) {
+        char *filename = strndup(trace + 14, strcspn(trace + 14, "\n"));
+        sprintf(hash, "trace %016llx\n", (unsigned long long)hashfile(filename));
+        append(&args, &argslen, hash);
+        free(filename);
+    }
+    atexit(flush_capture);
+    return 0;
+}
+
+/**
+* Function to give back the record of a protocol's run in the current
+* configuration, if there is one
+*
+* @param protocol protocol about to be run
+* @param metricsline where to put its --metrics line, to be freed
+* @return 1 if its output was printed from the cache, 0 if it has to run
+*/
+int cache_fetch(const struct proto_ops *protocol, char **metricsline) {
+    const struct cache_record *rec;
+    char id[2 * 64 + 1], path[4096];
+    struct stat st;
+    size_t expected;
+    ssize_t n;
+    int fd, hit = 0;
+
+    configlen = 0;
+    append(&config, &configlen, "protocol ");
+    append(&config, &configlen, protocol->name);
+    buildid((const void *)cache_open, id);
+    append(&config, &configlen, "\nexecutable ");
+    append(&config, &configlen, id);
+    buildid((const void *)protocol->A_output, id);
+    append(&config, &configlen, "\nprotocol build ");
+    append(&config, &configlen, id);
+    append(&config, &configlen, "\n");
+    append(&config, &configlen, args != NULL ? args : "");
+    key = fnv1a(FNV_BASIS, config, configlen);
+
+    snprintf(path, sizeof(path), "%s/%016llx.rec", cachedir, (unsigned long long)key);
+    if (refreshing || (fd = open(path, O_RDONLY)) < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*rec) &&
+        (rec = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+        expected = sizeof(*rec) + rec->configlen + rec->textlen + rec->metricslen;
+        if (memcmp(rec->magic, CACHE_MAGIC, 8) == 0 && rec->key == key &&
+            rec->configlen == configlen && (size_t)st.st_size == expected &&
+            memcmp(rec + 1, config, configlen) == 0) {
+            const char *text = (const char *)(rec + 1) + rec->configlen;
+            fflush(stdout);
+            for (size_t done = 0; done < rec->textlen; done += n) {
+                if ((n = write(STDOUT_FILENO, text + done, rec->textlen - done)) <= 0) {
+                    break;
+                }
+            }
+            *metricsline = rec->metricslen > 0 ? strndup(text + rec->textlen, rec->metricslen) : NULL;
+            hit = 1;
+        }
+        munmap((void *)rec, st.st_size);
+    }
+    close(fd);
+    return hit;
+}
+
+/**
+* Function to start capturing the report of a run for the cache, if it
+* is not being captured already
+*/
+void cache_begin() {
+    if (cachedir == NULL || captured != NULL) {
+        return;
+    }
+    fflush(stdout);
+    if ((captured = tmpfile()) == NULL || (savedfd = dup(STDOUT_FILENO)) < 0) {
+        perror("--cache");
+        if (captured != NULL) {
+            fclose(captured);
+            captured = NULL;
+        }
+        return;
+    }
+    dup2(fileno(captured), STDOUT_FILENO);
+}
+
+/**
+* Function to keep the --metrics line of the run for its record
+*
+* @param line JSON object and newline
+*/
+void cache_metrics(const char *line) {
+    free(metricsline);
+    metricsline = strdup(line);
+}
+
+/**
+* Function to stop capturing, and give the output to stdout
+*
+* @return the captured output mapped, NULL if empty, and its length
+*/
+static char *release_capture(size_t *len) {
+    char *text = NULL;
+    ssize_t n;
+
+    fflush(stdout);
+    dup2(savedfd, STDOUT_FILENO);
+    close(savedfd);
+    *len = lseek(fileno(captured), 0, SEEK_END);
+    if (*len > 0 && (text = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fileno(captured), 0)) == MAP_FAILED) {
+        text = NULL;
+        *len = 0;
+    }
+    for (size_t done = 0; done < *len; done += n) {
+        if ((n = write(STDOUT_FILENO, text + done, *len - done)) <= 0) {
+            break;
+        }
+    }
+    return text;
+}
+
+/**
+* Function to give a captured output to stdout if the run exits in the
+* middle, so nothing printed is lost
+*/
+static void flush_capture() {
+    size_t len;
+    char *text;
+
+    if (captured != NULL) {
+        if ((text = release_capture(&len)) != NULL) {
+            munmap(text, len);
+        }
+        fclose(captured);
+        captured = NULL;
+    }
+}
+
+/**
+* Function to end a run: give its output to stdout, and save it with its
+* --metrics line as the record of its configuration if it went well
+*
+* @param ok 1 if the run succeeded
+*/
+void cache_end(int ok) {
+    struct cache_record rec;
+    char path[4096], tmp[4096 + 16];   /* path and the pid */
+    size_t len;
+    char *text;
+    FILE *fp;
+
+    if (captured == NULL) {
+        return;
+    }
+    text = release_capture(&len);
+    if (ok) {
+        memset(&rec, 0, sizeof(rec));
+        memcpy(rec.magic, CACHE_MAGIC, 8);
+        rec.key = key;
+        rec.configlen = configlen;
+        rec.textlen = len;
+        rec.metricslen = metricsline != NULL ? strlen(metricsline) : 0;
+        rec.a_application = A_application;
+        rec.a_transport = A_transport;
+        rec.b_transport = B_transport;
+        rec.b_application = B_application;
+        rec.time = SIM_UNITS(simtime);
+
+        snprintf(path, sizeof(path), "%s/%016llx.rec", cachedir, (unsigned long long)key);
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+        if ((fp = fopen(tmp, "w")) == NULL) {
+            perror(tmp);
+        } else {
+            fwrite(&rec, sizeof(rec), 1, fp);
+            fwrite(config, 1, configlen, fp);
+            fwrite(text, 1, len, fp);
+            fwrite(metricsline, 1, rec.metricslen, fp);
+            if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+                perror(path);
+                unlink(tmp);
+            }
+        }
+    }
+    if (text != NULL) {
+        munmap(text, len);
+    }
+    free(metricsline);
+    metricsline = NULL;
+    fclose(captured);
+    captured = NULL;
+}
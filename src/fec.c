@@ -0,0 +1,321 @@
+#include "../include/fec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+* Forward erasure coding.
+*
+* Below the protocol, the packets A hands to layer 3 are numbered in
+* groups of fec_k, and after the last of a group the medium carries one
+* more packet, the XOR of the whole group, seqnum, acknum and checksum
+* included. A group still open fec_wait time units after its first packet
+* is closed there with fewer, so that a sender with little to send gets
+* its parity soon enough to beat its timeout. Parity packets do not count
+* as sent by the transport layer.
+*
+* B's decoder takes what arrives of a group. As soon as the parity and
+* all but one data packet are in, the missing one is the XOR of them all,
+* and is handed to B_input() without waiting for A to time out. To give
+* it to B in its place, packets that arrive after a gap in the group are
+* held until the gap is repaired, the parity turns out not to be enough,
+* or a later group starts. Only losses are repaired: a corrupted packet
+* goes to B as it is, for its checksum to reject. ACKs from B are not
+* coded.
+*
+* A packet that is only late looks lost to the decoder as well, and is
+* rebuilt all the same. The decoder keeps, for the last FEC_GROUPS groups,
+* which packets the medium did lose, so that only those count as
+* repaired, and which it rebuilt, so that the original arriving after its
+* copy is dropped rather than given to B twice.
+*/
+
+#define FEC_MAX 32
+#define FEC_GROUPS 256
+
+struct marks {
+    int group;          /* group they are of */
+    unsigned lost;      /* data packets lost in the medium, by index */
+    unsigned rebuilt;   /* data packets rebuilt by B, by index */
+};
+
+struct encoder {
+    int group;          /* group being filled */
+    int count;          /* its packets so far */
+    struct pkt parity;  /* their XOR */
+};
+
+struct decoder {
+    int group;                 /* group being received, -1 before any */
+    unsigned have;             /* data packets of it in, by index */
+    int size;                  /* its size, once the parity is in */
+    int next;                  /* next index to give to B */
+    struct pkt xor;            /* XOR of what came in, parity included */
+    struct pkt held[FEC_MAX];
+    struct marks marks[FEC_GROUPS];   /* of group g at g % FEC_GROUPS */
+};
+
+int fec_k = 0;
+float fec_wait = 0.0;
+
+static struct encoder *encoders = NULL;
+static struct decoder *decoders = NULL;
+static int ndata, nparity;          /* packets A sent */
+static int nshort;                  /* groups closed by fec_wait */
+static int nlostdata;               /* of them lost in the medium */
+static int nrepaired;               /* rebuilt by B */
+static int nheld;                   /* held back for a gap */
+
+/**
+* Function to XOR a packet into another
+*
+* @param into packet to update
+* @param from packet to add
+*/
+static void xorpacket(struct pkt *into, const struct pkt *from) {
+    into->seqnum ^= from->seqnum;
+    into->acknum ^= from->acknum;
+    into->checksum ^= from->checksum;
+    for (int i = 0; i < 20; ++i) {
+        into->payload[i] ^= from->payload[i];
+    }
+}
+
+/**
+* Function to set up coding for a run
+*
+* @param k data packets per group, 0 to code nothing
+* @param wait time units a group stays open at most, 0 for no limit
+* @param nflows number of flows
+*/
+void fec_init(int k, float wait, int nflows) {
+    fec_k = k;
+    fec_wait = wait;
+    free(encoders);
+    free(decoders);
+    encoders = calloc(nflows, sizeof(struct encoder));
+    decoders = calloc(nflows, sizeof(struct decoder));
+    for (int f = 0; f < nflows; ++f) {
+        decoders[f].group = -1;
+        for (int g = 0; g < FEC_GROUPS; ++g) {
+            decoders[f].marks[g].group = -1;
+        }
+    }
+    ndata = nparity = nshort = nlostdata = nrepaired = nheld = 0;
+}
+
+/**
+* Function to number a packet A sends, and make the parity of its group
+* once it is complete
+*
+* @param flow flow of the packet
+* @param packet packet sent
+* @param group where to put its group
+* @param index where to put its index in the group, 0 for the first
+* @param parity where to put the parity of the group
+* @return number of packets in the group if it is complete and the parity
+*         is to be sent after the packet, 0 otherwise
+*/
+int fec_encode(int flow, const struct pkt *packet, int *group, int *index, struct pkt *parity) {
+    struct encoder *enc = &encoders[flow];
+
+    if (enc->count == 0) {
+        memset(&enc->parity, 0, sizeof(enc->parity));
+    }
+    xorpacket(&enc->parity, packet);
+    *group = enc->group;
+    *index = enc->count++;
+    ndata++;
+    if (enc->count < fec_k) {
+        return 0;
+    }
+    *parity = enc->parity;
+    enc->group++;
+    enc->count = 0;
+    nparity++;
+    return fec_k;
+}
+
+/**
+* Function to close a group that is still open once its time is up
+*
+* @param flow flow of the group
+* @param group the group
+* @param parity where to put its parity
+* @return number of packets in the group if the parity is to be sent
+*         now, 0 if the group was closed already
+*/
+int fec_close(int flow, int group, struct pkt *parity) {
+    struct encoder *enc = &encoders[flow];
+    int n = enc->count;
+
+    if (enc->group != group || n == 0) {
+        return 0;
+    }
+    *parity = enc->parity;
+    enc->group++;
+    enc->count = 0;
+    nparity++;
+    nshort++;
+    return n;
+}
+
+/**
+* Function to find the marks of a group, making room for them if it is
+* newer than the one in their slot
+*
+* @return the marks, NULL if they are forgotten already
+*/
+static struct marks *marksof(struct decoder *dec, int group) {
+    struct marks *m = &dec->marks[group % FEC_GROUPS];
+
+    if (m->group < group) {
+        m->group = group;
+        m->lost = m->rebuilt = 0;
+    }
+    return m->group == group ? m : NULL;
+}
+
+/**
+* Function to count a coded packet lost in the medium
+*
+* @param flow flow of the packet
+* @param group its group
+* @param index its index in its group, minus the size of the group for
+*              a parity packet
+*/
+void fec_lost(int flow, int group, int index) {
+    struct marks *m;
+
+    if (index >= 0) {
+        nlostdata++;
+        if ((m = marksof(&decoders[flow], group)) != NULL) {
+            m->lost |= 1u << index;
+        }
+    }
+}
+
+/**
+* Function to give B the packets of the group in order, up to the first
+* one missing
+*/
+static void release(struct decoder *dec, void (*deliver)(struct pkt *packet, int rebuilt), unsigned rebuilt) {
+    while (dec->next < fec_k && (dec->have & (1u << dec->next)) != 0) {
+        deliver(&dec->held[dec->next], (rebuilt >> dec->next) & 1);
+        dec->next++;
+    }
+}
+
+/**
+* Function to give B what it has of the group, gaps and all
+*/
+static void flush(struct decoder *dec, void (*deliver)(struct pkt *packet, int rebuilt)) {
+    for (; dec->next < fec_k; dec->next++) {
+        if ((dec->have & (1u << dec->next)) != 0) {
+            deliver(&dec->held[dec->next], 0);
+        }
+    }
+}
+
+/**
+* Function to take a coded packet that arrived at B
+*
+* @param flow flow of the packet
+* @param group its group
+* @param index its index in the group, minus the size of the group for
+*              the parity
+* @param packet the packet
+* @param deliver called with each packet for B, in order, and whether it
+*                was rebuilt
+* @return 1 if the packet was dropped as B had its rebuilt copy, 0 if not
+*/
+int fec_receive(int flow, int group, int index, const struct pkt *packet,
+                void (*deliver)(struct pkt *packet, int rebuilt)) {
+    struct decoder *dec = &decoders[flow];
+    struct pkt copy = *packet;
+    struct marks *m;
+    unsigned missing;
+    int i, before;
+
+    // only late, and B has it already
+    if (index >= 0 && (m = marksof(dec, group)) != NULL && (m->rebuilt & (1u << index)) != 0) {
+        return 1;
+    }
+    if (group < dec->group) {
+        // reordered past its group, too late to help
+        if (index >= 0) {
+            deliver(&copy, 0);
+        }
+        return 0;
+    }
+    if (group > dec->group) {
+        if (dec->group >= 0) {
+            flush(dec, deliver);
+        }
+        dec->group = group;
+        dec->have = 0;
+        dec->next = 0;
+        dec->size = 0;
+        memset(&dec->xor, 0, sizeof(dec->xor));
+    }
+
+    if (index >= 0) {
+        if ((dec->have & (1u << index)) != 0) {
+            return 1;
+        }
+        if (index < dec->next) {
+            // reordered past a flush of its group
+            deliver(&copy, 0);
+            return 0;
+        }
+        dec->held[index] = copy;
+        dec->have |= 1u << index;
+    } else if (dec->size > 0) {
+        return 0;
+    } else {
+        dec->size = -index;
+    }
+    xorpacket(&dec->xor, &copy);
+
+    // with the parity, a single missing packet is what the XOR leaves
+    missing = ~dec->have & ((dec->size == 32 ? 0 : 1u << dec->size) - 1);
+    if (dec->size > 0 && missing != 0 && (missing & (missing - 1)) == 0) {
+        i = __builtin_ctz(missing);
+        dec->held[i] = dec->xor;
+        dec->have |= missing;
+        if ((m = marksof(dec, group)) != NULL) {
+            m->rebuilt |= missing;
+            if ((m->lost & missing) != 0) {
+                nrepaired++;
+            }
+        }
+        release(dec, deliver, missing);
+        return 0;
+    }
+
+    before = dec->next;
+    release(dec, deliver, 0);
+    if (index >= 0 && dec->next == before) {
+        nheld++;
+    }
+    // without reordering the parity comes last, so nothing more of the
+    // group will come in
+    if (dec->size > 0) {
+        flush(dec, deliver);
+    }
+    return 0;
+}
+
+/**
+* Function to report what coding did in the last run
+*
+* @param ndelivered messages delivered to layer 5
+* @param time simulated time of the run
+*/
+void fec_printstats(int ndelivered, double time) {
+    printf(" FEC: %d data packets in groups of %d, %d parity packets (%.1f%% more), %d for groups closed early\n",
+           ndata, fec_k, nparity, ndata > 0 ? 100.0 * nparity / ndata : 0.0, nshort);
+    printf(" FEC: %d data packets lost, %d repaired (%.1f%%), %d held for order, goodput %f packets/time unit\n",
+           nlostdata, nrepaired, nlostdata > 0 ? 100.0 * nrepaired / nlostdata : 0.0, nheld,
+           time > 0.0 ? ndelivered / time : 0.0);
+}
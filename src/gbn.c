@@ -5,7 +5,7 @@
 
 #define PAYLOAD_SIZE 20
 #define TIMEOUT 12.0
-#define NUM_MSGS 1500
+#define BACKLOG_SIZE 64
 
 /* ******************************************************************
  ALTERNATING BIT AND GO-BACK-N NETWORK EMULATOR: VERSION 1.1  J.F.Kurose
@@ -26,16 +26,36 @@
 *
 */
 
-/* A's state variables*/
-static int winsize_a;
-static int base_a;
-static int end_a;
-static int nextseqnum;
-static struct pkt *sndpkt = NULL;
+/* per-flow state, one copy for each flow of the simulation */
+struct flow_state {
+    /* A's state variables*/
+    int winsize_a;
+    int base_a;             // oldest unacknowledged seqnum
+    int nextseqnum;         // seqnum of the next packet sent for the first time
+    struct pkt *sndpkt;     // the window, a packet at seqnum % sndpkt_size
+    int sndpkt_size;
+    struct msg *backlog;    // messages waiting for room in the window
+    int backlog_head;
+    int backlog_count;
+    int backlog_size;
 
-/* B's state variables*/
-static int expseqnum;
-static struct pkt packet_b;
+    /* B's state variables*/
+    int expseqnum;
+    struct pkt packet_b;
+};
+static struct flow_state *flows = NULL;
+static __thread struct flow_state *st;   // state of the flow being run, per thread
+static unsigned seqmask;                 // seqnums count modulo seqmask + 1
+
+/**
+* Function to switch to the state of the flow the simulator is running
+*/
+static void select_flow() {
+    if (flows == NULL) {
+        flows = calloc(getnflows(), sizeof(struct flow_state));
+    }
+    st = &flows[getflow()];
+}
 
 /**
 * Checksum function.
@@ -65,53 +85,177 @@ static int corrupt(struct pkt *packet) {
     return 0;
 }
 
+/**
+* Function to add to a seqnum, modulo the sequence space
+*
+* @param seqnum sequence number
+* @param n how much to add
+*/
+static int seq_add(int seqnum, int n) {
+    return ((unsigned)seqnum + n) & seqmask;
+}
+
+/**
+* Function to count the seqnums from one to another, modulo the sequence space
+*
+* @param to later sequence number
+* @param from earlier sequence number
+*/
+static int seq_diff(int to, int from) {
+    return ((unsigned)to - (unsigned)from) & seqmask;
+}
+
+/**
+* Function to put a message at the end of the backlog
+*
+* @param message message that does not fit in the window
+*/
+static void backlog_push(struct msg *message) {
+    int i;
+
+    if (st->backlog_count == st->backlog_size) {
+        // grow, with the oldest message first again
+        struct msg *backlog = malloc(2 * st->backlog_size * sizeof(struct msg));
+        for (i = 0; i < st->backlog_count; ++i) {
+            backlog[i] = st->backlog[(st->backlog_head + i) % st->backlog_size];
+        }
+        free(st->backlog);
+        st->backlog = backlog;
+        st->backlog_head = 0;
+        st->backlog_size *= 2;
+    }
+    st->backlog[(st->backlog_head + st->backlog_count++) % st->backlog_size] = *message;
+}
+
+/**
+* Function to take the oldest message off the backlog
+*/
+static struct msg *backlog_pop() {
+    struct msg *message = &st->backlog[st->backlog_head];
+
+    st->backlog_head = (st->backlog_head + 1) % st->backlog_size;
+    --st->backlog_count;
+    return message;
+}
+
+/**
+* Function to make the packet of a message with the next seqnum, in the window
+*
+* @param message data of the packet
+* @return the packet
+*/
+static struct pkt *make_packet(struct msg *message) {
+    struct pkt *packet = &st->sndpkt[st->nextseqnum & (st->sndpkt_size - 1)];
+
+    memset(packet, 0, sizeof(struct pkt));
+    packet->seqnum = st->nextseqnum;
+    memcpy(packet->payload, message->data, PAYLOAD_SIZE);
+    packet->checksum = checksum(packet);
+    st->nextseqnum = seq_add(st->nextseqnum, 1);
+    return packet;
+}
+
+/**
+* Function to send n packets of the window from seqnum first, in one burst
+* unless they wrap around the end of the buffer
+*
+* @param first seqnum of the first packet
+* @param n number of packets
+*/
+static void send_window(int first, int n) {
+    int i = first & (st->sndpkt_size - 1);
+    int k = n < st->sndpkt_size - i ? n : st->sndpkt_size - i;
+
+    tolayer3_batch(0, &st->sndpkt[i], k);
+    tolayer3_batch(0, st->sndpkt, n - k);
+}
+
+/**
+* Function to send the buffered messages that fit in the window, in one burst
+*/
+static void send_buffered() {
+    int first = st->nextseqnum;
+    int n = 0;
+
+    while (st->backlog_count > 0 && seq_diff(st->nextseqnum, st->base_a) < st->winsize_a) {
+        make_packet(backlog_pop());
+        ++n;
+    }
+    if (n > 0) {
+        printf("sending buffered messages with seq num %d to %d\n", first, seq_add(first, n - 1));
+        send_window(first, n);
+    }
+}
+
+/**
+* Function to size a buffer of the window as a power of 2, so that seqnum
+* modulo its size is the same on both sides of a wraparound
+*
+* @param winsize window size
+*/
+static int window_buffer_size(int winsize) {
+    int size = 1;
+
+    while (size < winsize) {
+        size *= 2;
+    }
+    return size;
+}
+
+/**
+* Function to set up the sequence space, getseqbits() bits wide
+*/
+static void init_seqnums() {
+    int bits = getseqbits();
+
+    seqmask = (1u << bits) - 1;
+    // with the window a full sequence space, an ACK of the whole window
+    // would look like one from the window before
+    if ((unsigned)getwinsize() > seqmask) {
+        fprintf(stderr, "gbn needs a window below 2^%d with %d-bit seqnums\n", bits, bits);
+        exit(-1);
+    }
+}
+
 /* called from layer 5, passed the data to be sent to other side */
 void A_output(message)
   struct msg message;
 {
-    // create packet
-    memset(&sndpkt[nextseqnum], 0, sizeof(struct pkt));
-    sndpkt[nextseqnum].seqnum = nextseqnum;
-    memcpy(&sndpkt[nextseqnum].payload, &message.data, PAYLOAD_SIZE);
-    sndpkt[nextseqnum].checksum = checksum(&sndpkt[nextseqnum]);
+    struct pkt *packet;
 
-    if (nextseqnum < (base_a + winsize_a)) {
-        // send packet
-        tolayer3(0, sndpkt[nextseqnum]);
-        printf("%s sent %.20s seqnum:%d\n", __func__, message.data, nextseqnum);
-
-        // set the end of window to end_a
-        end_a = nextseqnum;
+    select_flow();
+    if (st->backlog_count == 0 && seq_diff(st->nextseqnum, st->base_a) < st->winsize_a) {
+        // create and send packet
+        packet = make_packet(&message);
+        tolayer3(0, *packet);
+        printf("%s sent %.20s seqnum:%d\n", __func__, message.data, packet->seqnum);
 
         // if sending first packet in window, start timer
-        if (base_a == nextseqnum) {
+        if (st->base_a == packet->seqnum) {
             starttimer(0, TIMEOUT);
         }
     } else {
-        // buffer message
-        printf("%s: message buffered %.20s with seq num %d\n", __func__, message.data, nextseqnum);
+        // buffer message, it gets its seq num when it is sent
+        backlog_push(&message);
+        printf("%s: message buffered %.20s with seq num %d\n", __func__, message.data,
+               seq_add(st->nextseqnum, st->backlog_count - 1));
     }
-    // increment seq num
-    ++nextseqnum;
 }
 
 /* called from layer 3, when a packet arrives for layer 4 */
 void A_input(packet)
   struct pkt packet;
 {
-    if (!corrupt(&packet) && packet.acknum >= base_a) {
+    select_flow();
+    if (!corrupt(&packet) && seq_diff(packet.acknum, st->base_a) < seq_diff(st->nextseqnum, st->base_a)) {
         // slide the window forward
-        base_a = packet.acknum + 1;
-        printf("%s:move base_a:%d akcnum:%d\n", __func__, base_a, packet.acknum);
+        st->base_a = seq_add(packet.acknum, 1);
+        printf("%s:move base_a:%d akcnum:%d\n", __func__, st->base_a, packet.acknum);
 
         // if there are any buffered messages, send them
-        for (int i = end_a + 1; (i < nextseqnum && i < (base_a + winsize_a)); ++i) {
-            printf("sending buffered message %.20s with deq num %d", sndpkt[i].payload, sndpkt[i].seqnum);
-            tolayer3(0, sndpkt[i]);
-            end_a = i;
-        }
+        send_buffered();
 
-        if (base_a == nextseqnum) {
+        if (st->base_a == st->nextseqnum) {
             // all packets ACK'ed
             stoptimer(0);
         } else {
@@ -127,13 +271,15 @@ void A_input(packet)
 /* called when A's timer goes off */
 void A_timerinterrupt()
 {
+    select_flow();
     // start the timer
     starttimer(0, TIMEOUT);
 
     // resend all the un-ACK'ed packets
-    for (int i = base_a; i < end_a; ++i) {
-        printf("%s: resend seqnum:%d\n", __func__, i);
-        tolayer3(0, sndpkt[i]);
+    int n = seq_diff(st->nextseqnum, st->base_a) - 1;
+    if (n > 0) {
+        printf("%s: resend seqnum:%d to %d\n", __func__, st->base_a, seq_add(st->base_a, n - 1));
+        send_window(st->base_a, n);
     }
 }  
 
@@ -141,45 +287,106 @@ void A_timerinterrupt()
 /* entity A routines are called. You can use it to do any initialization */
 void A_init()
 {
+    select_flow();
+    init_seqnums();
+
     // get the window size
-    winsize_a = getwinsize();
+    st->winsize_a = getwinsize();
 
     // set the base and nextseqnum
-    base_a = 1;
-    nextseqnum = 1;
+    st->base_a = 1;
+    st->nextseqnum = 1;
 
-    // allocate buffers
-    if (sndpkt == NULL) {
-        sndpkt = malloc(NUM_MSGS * sizeof(struct pkt));
+    // allocate buffers, the size of the window
+    if (st->sndpkt == NULL) {
+        st->sndpkt_size = window_buffer_size(st->winsize_a);
+        st->sndpkt = malloc(st->sndpkt_size * sizeof(struct pkt));
+        st->backlog_size = BACKLOG_SIZE;
+        st->backlog = malloc(BACKLOG_SIZE * sizeof(struct msg));
     }
+    st->backlog_head = 0;
+    st->backlog_count = 0;
 }
 
 /* Note that with simplex transfer from a-to-B, there is no B_output() */
 
+/* report the window state to the simulator */
+void get_proto_stats(struct proto_stats *stats)
+{
+    select_flow();
+    stats->snd_base = st->base_a;
+    stats->snd_next = st->base_a + seq_diff(st->nextseqnum, st->base_a);
+    stats->snd_unsent = st->backlog_count;
+    stats->snd_window = st->winsize_a;
+
+    // B keeps nothing out of order
+    stats->rcv_buffered = 0;
+}
+
+/* save the protocol state for a simulator snapshot */
+void proto_save()
+{
+    for (int f = 0; f < getnflows(); ++f) {
+        st = &flows[f];
+        snapshot_write(&st->base_a, sizeof(st->base_a));
+        snapshot_write(&st->nextseqnum, sizeof(st->nextseqnum));
+        snapshot_write(st->sndpkt, st->sndpkt_size * sizeof(struct pkt));
+        snapshot_write(&st->backlog_count, sizeof(st->backlog_count));
+        for (int i = 0; i < st->backlog_count; ++i) {
+            snapshot_write(&st->backlog[(st->backlog_head + i) % st->backlog_size], sizeof(struct msg));
+        }
+        snapshot_write(&st->expseqnum, sizeof(st->expseqnum));
+        snapshot_write(&st->packet_b, sizeof(st->packet_b));
+    }
+}
+
+/* restore the protocol state from a simulator snapshot */
+void proto_restore()
+{
+    for (int f = 0; f < getnflows(); ++f) {
+        struct msg message;
+        int n;
+
+        st = &flows[f];
+        snapshot_read(&st->base_a, sizeof(st->base_a));
+        snapshot_read(&st->nextseqnum, sizeof(st->nextseqnum));
+        snapshot_read(st->sndpkt, st->sndpkt_size * sizeof(struct pkt));
+        snapshot_read(&n, sizeof(n));
+        st->backlog_head = st->backlog_count = 0;
+        for (int i = 0; i < n; ++i) {
+            snapshot_read(&message, sizeof(message));
+            backlog_push(&message);
+        }
+        snapshot_read(&st->expseqnum, sizeof(st->expseqnum));
+        snapshot_read(&st->packet_b, sizeof(st->packet_b));
+    }
+}
+
 /* called from layer 3, when a packet arrives for layer 4 at B*/
 void B_input(packet)
   struct pkt packet;
 {
-    if (!corrupt(&packet) && packet.seqnum == expseqnum) {
+    select_flow();
+    if (!corrupt(&packet) && packet.seqnum == st->expseqnum) {
         // deliver packet
         tolayer5 (1, packet.payload);
         printf("%s: delivered %.20s seqnum:%d\n", __func__, packet.payload, packet.seqnum);
 
         // create ACK packet
-        memset(&packet_b, 0, sizeof(struct pkt));
-        packet_b.acknum = expseqnum;
-        packet_b.checksum = checksum(&packet_b);
+        memset(&st->packet_b, 0, sizeof(struct pkt));
+        st->packet_b.acknum = st->expseqnum;
+        st->packet_b.checksum = checksum(&st->packet_b);
 
         // send ACK
-        printf("%s: sent acknum:%d\n", __func__, packet_b.acknum);
-        tolayer3(1, packet_b);
+        printf("%s: sent acknum:%d\n", __func__, st->packet_b.acknum);
+        tolayer3(1, st->packet_b);
 
         // increment expected seqnum
-        ++expseqnum;
+        st->expseqnum = seq_add(st->expseqnum, 1);
     } else {
         // send duplicate ACK and drop this packet
-        printf("%s: sent duplicate acknum:%d\n", __func__, packet_b.acknum);
-        tolayer3(1, packet_b);
+        printf("%s: sent duplicate acknum:%d\n", __func__, st->packet_b.acknum);
+        tolayer3(1, st->packet_b);
     }
 }
 
@@ -187,5 +394,10 @@ void B_input(packet)
 /* entity B routines are called. You can use it to do any initialization */
 void B_init()
 {
-    expseqnum = 1;
+    select_flow();
+    init_seqnums();
+    st->expseqnum = 1;
 }
+
+/* entry points for the simulator */
+PROTOCOL(gbn);
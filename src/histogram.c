@@ -0,0 +1,103 @@
+#include "../include/histogram.h"
+#include <string.h>
+
+/**
+* Log-linear histogram in the style of HdrHistogram.
+* Recording is a couple of shifts and an increment, and the bucket array
+* is fixed size, so nothing is allocated while a run is going on.
+*/
+
+/**
+* Function to map a value to its bucket index
+*
+* @param value value to be recorded
+*/
+static int bucket_of(uint64_t value) {
+    int msb;
+
+    if (value < HIST_SUB_COUNT) {
+        return (int)value;
+    }
+    msb = 63 - __builtin_clzll(value);
+    // top HIST_SUB_BITS bits below the msb pick the sub bucket
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB_COUNT
+        + (int)((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+/**
+* Function to get the largest value that falls into a bucket
+*
+* @param index bucket index
+*/
+static uint64_t bucket_top(int index) {
+    int shift;
+    uint64_t base;
+
+    if (index < HIST_SUB_COUNT) {
+        return (uint64_t)index;
+    }
+    shift = index / HIST_SUB_COUNT - 1;
+    base = (uint64_t)(HIST_SUB_COUNT + index % HIST_SUB_COUNT) << shift;
+    return base + ((uint64_t)1 << shift) - 1;
+}
+
+void hist_init(struct histogram *h) {
+    memset(h, 0, sizeof(struct histogram));
+    h->min = UINT64_MAX;
+}
+
+void hist_record(struct histogram *h, uint64_t value) {
+    h->buckets[bucket_of(value)]++;
+    h->count++;
+    h->sum += (double)value;
+    if (value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+void hist_merge(struct histogram *into, const struct histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->min < into->min) {
+        into->min = from->min;
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+/**
+* Function to get the value at a percentile
+*
+* @param percentile between 0 and 100
+* @return upper bound of the bucket holding the percentile, 0 if empty
+*/
+uint64_t hist_percentile(const struct histogram *h, double percentile) {
+    uint64_t rank, seen = 0;
+
+    if (h->count == 0) {
+        return 0;
+    }
+    rank = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+double hist_mean(const struct histogram *h) {
+    return h->count ? h->sum / h->count : 0.0;
+}
@@ -0,0 +1,327 @@
+#include "../include/metrics.h"
+#include "../include/histogram.h"
+#include "../include/snapshot.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+* Per-run metrics: end-to-end latency, retransmissions, duplicates,
+* timeouts and goodput.
+*
+* Every message generated at layer 5 carries its id in the last TAG_SIZE
+* bytes of the payload, so the copies seen at tolayer3 and tolayer5 can
+* be matched to the time the message was created. Ids are numbered flow
+* by flow, -m of them per flow, so they also tell the flow.
+*/
+
+#define PAYLOAD_SIZE 20
+#define TAG_SIZE 8
+#define TAG_OFFSET (PAYLOAD_SIZE - TAG_SIZE)
+
+/* latencies are recorded in ticks */
+#define LATENCY_SCALE ((double)TICKS_PER_UNIT)
+
+#define MSG_SENT      0x1
+#define MSG_DELIVERED 0x2
+
+extern int A_application;
+extern int A_transport;
+extern int B_application;
+extern int B_transport;
+extern int ntolayer3;
+extern int nlost;
+extern int ncorrupt;
+extern int nreordered;
+extern float lossprob;
+extern float corruptprob;
+extern float lambda;
+extern int win_size;
+extern long nprocessed;
+
+static int maxmsgs;
+static int ntagged;
+static sim_ticks_t *created = NULL;
+static unsigned char *flags = NULL;
+static struct histogram latency;
+
+static int nretransmit;
+static int nduplicate;
+static int nunknown;
+static int ntimeout;
+static int ndelivered;
+static struct timespec wall_start;
+
+/* per-flow totals, kept small since there can be thousands of flows */
+struct flow_metrics {
+    int ndelivered;
+    double latency_sum;
+    sim_ticks_t latency_max;
+};
+static int nflows;
+static int msgsperflow;
+static struct flow_metrics *flowstats = NULL;
+
+/**
+* Function to read the message id back from a payload
+*
+* @return message id, or -1 if the tag was damaged
+*/
+int metrics_id(const char *data) {
+    int id = 0;
+
+    for (int i = TAG_OFFSET; i < PAYLOAD_SIZE; ++i) {
+        char c = data[i];
+        if (c >= '0' && c <= '9') {
+            id = id * 16 + (c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            id = id * 16 + (c - 'a' + 10);
+        } else {
+            return -1;
+        }
+    }
+    return id < maxmsgs ? id : -1;
+}
+
+/**
+* Function to allocate the per-message tables
+*
+* @param nmsgs number of messages each flow will generate
+* @param flowcount number of flows
+*/
+void metrics_init(int nmsgs, int flowcount) {
+    maxmsgs = nmsgs * flowcount;
+    msgsperflow = nmsgs > 0 ? nmsgs : 1;
+    nflows = flowcount;
+    free(created);
+    free(flags);
+    free(flowstats);
+    created = malloc((maxmsgs + 1) * sizeof(sim_ticks_t));
+    flags = calloc(maxmsgs + 1, 1);
+    flowstats = calloc(nflows, sizeof(struct flow_metrics));
+    hist_init(&latency);
+    ntagged = 0;
+    nretransmit = nduplicate = nunknown = ntimeout = ndelivered = 0;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+}
+
+/**
+* Function to stamp a fresh layer 5 message with its id
+*
+* @param message message about to be given to A_output
+* @param id message number
+*/
+void metrics_tag(struct msg *message, int id) {
+    static const char hex[] = "0123456789abcdef";
+
+    for (int i = PAYLOAD_SIZE - 1; i >= TAG_OFFSET; --i) {
+        message->data[i] = hex[id & 0xf];
+        id >>= 4;
+    }
+}
+
+/**
+* Function to note the creation of a tagged message
+*
+* @param id message number
+* @param now creation time
+*/
+void metrics_created(int id, sim_ticks_t now) {
+    if (id >= 0 && id < maxmsgs) {
+        created[id] = now;
+        if (id >= ntagged) {
+            ntagged = id + 1;
+        }
+    }
+}
+
+/**
+* Function to count a data packet handed to layer 3
+*
+* @param AorB sending entity
+* @param packet packet as given by the protocol
+*/
+void metrics_sent(int AorB, const struct pkt *packet) {
+    int id;
+
+    if (AorB != 0) {
+        return;
+    }
+    id = metrics_id(packet->payload);
+    if (id < 0) {
+        return;
+    }
+    if (flags[id] & MSG_SENT) {
+        nretransmit++;
+    }
+    flags[id] |= MSG_SENT;
+}
+
+/**
+* Function to account a message delivered to layer 5
+*
+* @param AorB receiving entity
+* @param data delivered payload
+* @param now delivery time
+*/
+void metrics_delivered(int AorB, char data[], sim_ticks_t now) {
+    struct flow_metrics *fm;
+    int id;
+
+    if (AorB != 1) {
+        return;
+    }
+    id = metrics_id(data);
+    if (id < 0) {
+        nunknown++;
+        return;
+    }
+    if (flags[id] & MSG_DELIVERED) {
+        nduplicate++;
+        return;
+    }
+    flags[id] |= MSG_DELIVERED;
+    ndelivered++;
+    hist_record(&latency, (uint64_t)(now - created[id]));
+
+    fm = &flowstats[id / msgsperflow];
+    fm->ndelivered++;
+    fm->latency_sum += now - created[id];
+    if (now - created[id] > fm->latency_max) {
+        fm->latency_max = now - created[id];
+    }
+}
+
+void metrics_timeout() {
+    ntimeout++;
+}
+
+/**
+* Function to get the messages delivered so far and their summed latency
+*
+* @param delivered where to put the number of messages
+* @param latency_sum where to put the sum of their latencies, in time units
+*/
+void metrics_totals(int *delivered, double *latency_sum) {
+    *delivered = ndelivered;
+    *latency_sum = latency.sum / LATENCY_SCALE;
+}
+
+/**
+* Function to save the metrics for a snapshot
+*/
+void metrics_save() {
+    snapshot_write(&ntagged, sizeof(ntagged));
+    snapshot_write(created, ntagged * sizeof(sim_ticks_t));
+    snapshot_write(flags, ntagged);
+    snapshot_write(&latency, sizeof(latency));
+    snapshot_write(&nretransmit, sizeof(nretransmit));
+    snapshot_write(&nduplicate, sizeof(nduplicate));
+    snapshot_write(&nunknown, sizeof(nunknown));
+    snapshot_write(&ntimeout, sizeof(ntimeout));
+    snapshot_write(&ndelivered, sizeof(ndelivered));
+    snapshot_write(flowstats, nflows * sizeof(struct flow_metrics));
+}
+
+/**
+* Function to restore the metrics from a snapshot.
+* The tables keep the size given to metrics_init() for this run.
+*/
+void metrics_restore() {
+    snapshot_read(&ntagged, sizeof(ntagged));
+    if (ntagged > maxmsgs) {
+        fprintf(stderr, "Snapshot has already sent %d msgs, more than -m\n", ntagged);
+        exit(-1);
+    }
+    snapshot_read(created, ntagged * sizeof(sim_ticks_t));
+    snapshot_read(flags, ntagged);
+    snapshot_read(&latency, sizeof(latency));
+    snapshot_read(&nretransmit, sizeof(nretransmit));
+    snapshot_read(&nduplicate, sizeof(nduplicate));
+    snapshot_read(&nunknown, sizeof(nunknown));
+    snapshot_read(&ntimeout, sizeof(ntimeout));
+    snapshot_read(&ndelivered, sizeof(ndelivered));
+    snapshot_read(flowstats, nflows * sizeof(struct flow_metrics));
+}
+
+/**
+* Function to compute Jain's fairness index of the flows' deliveries,
+* 1 when all flows got the same throughput, 1/n when one got it all
+*/
+static double fairness() {
+    double sum = 0.0, sumsq = 0.0;
+
+    for (int f = 0; f < nflows; ++f) {
+        sum += flowstats[f].ndelivered;
+        sumsq += (double)flowstats[f].ndelivered * flowstats[f].ndelivered;
+    }
+    return sumsq > 0 ? sum * sum / (nflows * sumsq) : 1.0;
+}
+
+static double flow_latency_mean(const struct flow_metrics *fm) {
+    return fm->ndelivered ? fm->latency_sum / fm->ndelivered / LATENCY_SCALE : 0.0;
+}
+
+/**
+* Function to print the throughput and latency of every flow
+*
+* @param now simulated time at the end of the run
+*/
+void metrics_print_flows(sim_ticks_t now) {
+    double t = now > 0 ? SIM_UNITS(now) : 1;
+
+    for (int f = 0; f < nflows; ++f) {
+        printf(" flow %d: %d msgs delivered, throughput %f, latency mean %f max %f\n",
+               f, flowstats[f].ndelivered, flowstats[f].ndelivered / t,
+               flow_latency_mean(&flowstats[f]), flowstats[f].latency_max / LATENCY_SCALE);
+    }
+    printf(" Jain fairness index %f over %d flows\n", fairness(), nflows);
+}
+
+/**
+* Function to write the metrics of the run as one JSON object
+*
+* @param fp output stream
+* @param protocol protocol name
+* @param now simulated time at the end of the run
+*/
+void metrics_write(FILE *fp, const char *protocol, sim_ticks_t now) {
+    double t = now > 0 ? SIM_UNITS(now) : 1;
+    double wall;
+    struct timespec wall_end;
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    wall = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+
+    fprintf(fp, "{\"protocol\":\"%s\",\"window\":%d,\"loss\":%g,\"corruption\":%g,\"lambda\":%g,",
+            protocol, win_size, lossprob, corruptprob, lambda);
+    fprintf(fp, "\"time\":%f,\"a_application\":%d,\"a_transport\":%d,\"b_transport\":%d,\"b_application\":%d,",
+            SIM_UNITS(now), A_application, A_transport, B_transport, B_application);
+    fprintf(fp, "\"tolayer3\":%d,\"lost\":%d,\"corrupted\":%d,\"reordered\":%d,",
+            ntolayer3, nlost, ncorrupt, nreordered);
+    fprintf(fp, "\"retransmissions\":%d,\"timeouts\":%d,\"delivered\":%d,\"duplicates\":%d,\"unknown\":%d,",
+            nretransmit, ntimeout, ndelivered, nduplicate, nunknown);
+    fprintf(fp, "\"events\":%ld,\"wall_seconds\":%f,\"events_per_second\":%f,",
+            nprocessed, wall, wall > 0 ? nprocessed / wall : 0.0);
+    fprintf(fp, "\"throughput\":%f,\"raw_throughput\":%f,\"goodput\":%f,",
+            B_application / t, A_transport / t, ndelivered / t);
+    fprintf(fp, "\"latency\":{\"count\":%llu,\"min\":%f,\"mean\":%f,\"p50\":%f,\"p90\":%f,\"p99\":%f,\"p999\":%f,\"max\":%f}",
+            (unsigned long long)latency.count,
+            latency.count ? latency.min / LATENCY_SCALE : 0.0,
+            hist_mean(&latency) / LATENCY_SCALE,
+            hist_percentile(&latency, 50.0) / LATENCY_SCALE,
+            hist_percentile(&latency, 90.0) / LATENCY_SCALE,
+            hist_percentile(&latency, 99.0) / LATENCY_SCALE,
+            hist_percentile(&latency, 99.9) / LATENCY_SCALE,
+            latency.max / LATENCY_SCALE);
+    if (nflows > 1) {
+        fprintf(fp, ",\"fairness\":%f,\"flows\":[", fairness());
+        for (int f = 0; f < nflows; ++f) {
+            fprintf(fp, "%s{\"delivered\":%d,\"throughput\":%f,\"latency_mean\":%f,\"latency_max\":%f}",
+                    f ? "," : "", flowstats[f].ndelivered, flowstats[f].ndelivered / t,
+                    flow_latency_mean(&flowstats[f]), flowstats[f].latency_max / LATENCY_SCALE);
+        }
+        fprintf(fp, "]");
+    }
+    fprintf(fp, "}\n");
+}
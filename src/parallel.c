@@ -0,0 +1,302 @@
+#include "../include/parallel.h"
+#include "../include/event.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+* Conservative parallel simulation.
+*
+* The flows only meet at the medium: the shared bottleneck link and the
+* global counters and metrics. Each worker thread owns the flows f with
+* f % nthreads equal to its number, with their events and protocol state,
+* and runs them a window at a time. A packet put on the medium arrives at
+* least one time unit later, so no event of a window can be caused by
+* another flow's event of the same window when windows are one time unit
+* long (the lookahead).
+*
+* Inside a window the workers handle their events as the sequential loop
+* would, but log what reaches outside the flow instead of doing it: the
+* accounting of each event, packets handed to layer 3 and data handed to
+* layer 5. Between windows the main thread merges the logs by time and
+* flow, the order the sequential loop handles the events in, and replays
+* them, putting the packets on the medium and into the queue of the
+* worker owning their flow. The results are the same as a sequential run.
+*/
+
+#define REC_EVENT    0   /* accountevent() */
+#define REC_TOLAYER3 1   /* sendpacket() */
+#define REC_TOLAYER5 2   /* deliverdata() */
+
+struct record {
+    sim_ticks_t time;    /* time of the event that made it */
+    int flow;
+    int kind;            /* one of REC_* */
+    int AorB;
+    int evtype;          /* REC_EVENT */
+    int id;              /* REC_EVENT */
+    long long seq;       /* REC_TOLAYER3 */
+    struct pkt packet;   /* REC_TOLAYER3, payload only for REC_TOLAYER5 */
+};
+
+struct worker {
+    pthread_t thread;
+    struct evqueue queue;
+    struct record *log;  /* what the current window left to the main thread */
+    int nlog;
+    int logsize;
+    int next;            /* next record to merge */
+};
+
+static struct worker *workers;
+static int nworkers;
+static pthread_barrier_t barrier;
+static sim_ticks_t horizon;     /* end of the current window, exclusive */
+static int stopping;
+
+/* the worker the calling thread is, NULL in the main thread */
+static __thread struct worker *self = NULL;
+
+/**
+* Function to append a record for the current event to the log
+*
+* @param kind one of REC_*
+* @param AorB entity
+* @return the record to fill in
+*/
+static struct record *logrecord(int kind, int AorB) {
+    struct record *r;
+
+    if (self->nlog == self->logsize) {
+        self->logsize = self->logsize ? 2 * self->logsize : 64;
+        self->log = realloc(self->log, self->logsize * sizeof(struct record));
+    }
+    r = &self->log[self->nlog++];
+    r->time = simtime;
+    r->flow = curflow;
+    r->kind = kind;
+    r->AorB = AorB;
+    return r;
+}
+
+/**
+* Function to defer the accounting of an event handled by a worker
+*
+* @param evtype event type, or the stop of a flow
+* @param AorB entity
+* @param id message number of a layer 5 arrival
+* @return 1 if deferred, 0 if the caller is not a worker
+*/
+int parallel_defer_event(int evtype, int AorB, int id) {
+    struct record *r;
+
+    if (self == NULL) {
+        return 0;
+    }
+    r = logrecord(REC_EVENT, AorB);
+    r->evtype = evtype;
+    r->id = id;
+    return 1;
+}
+
+/**
+* Function to defer packets handed to layer 3 by a worker
+*
+* @param AorB sending entity
+* @param pkts packets to send, in order
+* @param n number of packets
+* @param seq scheduling order of the first arrival within the flow
+* @return 1 if deferred, 0 if the caller is not a worker
+*/
+int parallel_defer_packets(int AorB, const struct pkt *pkts, int n, long long seq) {
+    struct record *r;
+
+    if (self == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < n; ++i) {
+        r = logrecord(REC_TOLAYER3, AorB);
+        r->seq = seq + i;
+        r->packet = pkts[i];
+    }
+    return 1;
+}
+
+/**
+* Function to defer data handed to layer 5 by a worker
+*
+* @param AorB receiving entity
+* @param data 20 bytes of data
+* @return 1 if deferred, 0 if the caller is not a worker
+*/
+int parallel_defer_data(int AorB, char data[]) {
+    struct record *r;
+
+    if (self == NULL) {
+        return 0;
+    }
+    r = logrecord(REC_TOLAYER5, AorB);
+    memcpy(r->packet.payload, data, sizeof(r->packet.payload));
+    return 1;
+}
+
+/**
+* Function run by each worker thread, a window at a time
+*
+* @param arg its struct worker
+*/
+static void *work(void *arg) {
+    struct event *e;
+
+    self = arg;
+    evq = &self->queue;
+    for (;;) {
+        pthread_barrier_wait(&barrier);
+        if (stopping) {
+            break;
+        }
+        while ((e = nextevent()) != NULL && e->evtime < horizon) {
+            handleevent(removeevent());
+        }
+        pthread_barrier_wait(&barrier);
+    }
+    return NULL;
+}
+
+/**
+* Function to replay the logs of a window in sequential order
+*
+* @return number of flows that stopped in the window
+*/
+static int merge(void) {
+    struct worker *w, *best;
+    struct record *r, *q = NULL;
+    int i, nstopped = 0;
+
+    for (;;) {
+        best = NULL;
+        for (i = 0; i < nworkers; ++i) {
+            w = &workers[i];
+            if (w->next == w->nlog) {
+                continue;
+            }
+            r = &w->log[w->next];
+            if (best == NULL || r->time < q->time ||
+                (r->time == q->time && r->flow < q->flow)) {
+                best = w;
+                q = r;
+            }
+        }
+        if (best == NULL) {
+            break;
+        }
+        best->next++;
+        simtime = q->time;
+        curflow = q->flow;
+        evq = &best->queue;
+        if (q->kind == REC_EVENT) {
+            accountevent(q->evtype, q->AorB, q->id);
+            if (q->evtype < 0) {
+                nstopped++;
+            }
+        } else if (q->kind == REC_TOLAYER3) {
+            sendpacket(q->AorB, &q->packet, q->seq);
+        } else {
+            deliverdata(q->AorB, q->packet.payload);
+        }
+    }
+    for (i = 0; i < nworkers; ++i) {
+        workers[i].nlog = workers[i].next = 0;
+    }
+    evq = &mainq;
+    return nstopped;
+}
+
+/**
+* Function to simulate the events on the main queue with worker threads
+*
+* @param nthreads number of workers, at most one per flow is used
+* @return 0 on success, -1 on error
+*/
+int parallel_run(int nthreads) {
+    struct event *e;
+    sim_ticks_t start, end;
+    int i, err, nflowsdone = 0;
+
+    nworkers = nthreads < nflows ? nthreads : nflows;
+    workers = calloc(nworkers, sizeof(struct worker));
+
+    // hand the events of each flow to its worker, keeping their order
+    while (mainq.nevents > 0) {
+        e = removeevent();
+        evq = &workers[e->flow % nworkers].queue;
+        if (e->evtype == FROM_LAYER3) {
+            evq->ninflight[e->eventity]++;
+        }
+        heapinsert(e);
+        evq = &mainq;
+    }
+
+    stopping = 0;
+    pthread_barrier_init(&barrier, NULL, nworkers + 1);
+    for (i = 0; i < nworkers; ++i) {
+        // the others would wait at the barrier for it forever
+        if ((err = pthread_create(&workers[i].thread, NULL, work, &workers[i])) != 0) {
+            fprintf(stderr, "Cannot start worker thread: %s\n", strerror(err));
+            exit(-1);
+        }
+    }
+
+    while (nflowsdone < nflows) {
+        // the window starts at the earliest pending event of any flow
+        start = -1;
+        for (i = 0; i < nworkers; ++i) {
+            evq = &workers[i].queue;
+            if ((e = nextevent()) != NULL && (start < 0 || e->evtime < start)) {
+                start = e->evtime;
+            }
+        }
+        evq = &mainq;
+        if (start < 0) {
+            break;
+        }
+        horizon = start + TICKS_PER_UNIT;
+        pthread_barrier_wait(&barrier);
+        pthread_barrier_wait(&barrier);
+        nflowsdone += merge();
+    }
+
+    // the workers wait for a window that will not come
+    stopping = 1;
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < nworkers; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    pthread_barrier_destroy(&barrier);
+
+    // the run ends when the last flow stops
+    end = simtime;
+    for (i = 0; i < nflows; ++i) {
+        if (flows[i].done && flows[i].stoptime > end) {
+            end = flows[i].stoptime;
+        }
+    }
+    simtime = end;
+
+    for (i = 0; i < nworkers; ++i) {
+        evq = &workers[i].queue;
+        while (evq->nevents > 0) {
+            freeevent(removeevent());
+        }
+        while ((e = evq->pool) != NULL) {
+            evq->pool = e->nextfree;
+            free(e);
+        }
+        free(evq->heap);
+        free(workers[i].log);
+    }
+    evq = &mainq;
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,197 @@
+#include "../include/perf.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+* Hardware performance counters.
+* The counters are one perf_event_open() group on the calling thread,
+* counting user space only, so the read() done at every change of phase
+* costs little in what is counted. What the counters advanced by between
+* two changes goes to the phase that was running. The phases nest:
+* tolayer3() called from A_output() counts as tolayer3, the rest of
+* A_output() as the protocol.
+*
+* Counters the machine or the kernel does not offer, for instance in a
+* virtual machine or under perf_event_paranoid, are left out of the
+* report, and the run goes on without any if none can be opened.
+*/
+
+#define PERF_NCOUNTERS 4
+
+static const struct {
+    const char *name;
+    uint64_t config;
+} counters[PERF_NCOUNTERS] = {
+    { "cycles",        PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",  PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache-misses",  PERF_COUNT_HW_CACHE_MISSES },
+    { "branch-misses", PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+int perf_active = 0;
+
+static int fds[PERF_NCOUNTERS];         /* -1 for a counter not available */
+static int leader = -1;                 /* fd of the group */
+static int nopen;
+static int phase;
+static uint64_t last[PERF_NCOUNTERS];   /* counts at the last change of phase */
+static uint64_t totals[PERF_NPHASES][PERF_NCOUNTERS];
+static long nswitches;
+
+/**
+* Function to open one counter, in the group once there is one
+*
+* @param config PERF_COUNT_HW_ event
+* @return fd, or -1 if the counter is not available
+*/
+static int open_counter(uint64_t config) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = leader < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+/**
+* Function to read the group into last's order
+*
+* @param values where to put the counts, 0 for counters not open
+* @return 0 on success, -1 on error
+*/
+static int read_counters(uint64_t *values) {
+    uint64_t buf[1 + PERF_NCOUNTERS];
+    int n = 0;
+
+    if (read(leader, buf, sizeof(buf)) < (ssize_t)((1 + nopen) * sizeof(uint64_t))) {
+        return -1;
+    }
+    // the group gives the counts in the order the counters were opened
+    for (int i = 0; i < PERF_NCOUNTERS; ++i) {
+        values[i] = fds[i] >= 0 ? buf[1 + n++] : 0;
+    }
+    return 0;
+}
+
+/**
+* Function to open and start the counters for a run
+*
+* @return 0 on success, -1 if no counter is available
+*/
+int perf_open() {
+    int err = 0;
+
+    leader = -1;
+    nopen = 0;
+    for (int i = 0; i < PERF_NCOUNTERS; ++i) {
+        if ((fds[i] = open_counter(counters[i].config)) < 0) {
+            err = errno;
+            continue;
+        }
+        if (leader < 0) {
+            leader = fds[i];
+        }
+        nopen++;
+    }
+    if (leader < 0) {
+        fprintf(stderr, "--perf: no hardware counters (%s), running without\n", strerror(err));
+        return -1;
+    }
+    memset(totals, 0, sizeof(totals));
+    nswitches = 0;
+    phase = PERF_SIMULATOR;
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    if (read_counters(last) < 0) {
+        fprintf(stderr, "--perf: cannot read the counters, running without\n");
+        for (int i = 0; i < PERF_NCOUNTERS; ++i) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+        return -1;
+    }
+    perf_active = 1;
+    return 0;
+}
+
+/**
+* Function to charge the counts so far to the running phase, and switch
+*
+* @param next phase starting now
+* @return the phase that was running
+*/
+int perf_switch(int next) {
+    uint64_t now[PERF_NCOUNTERS];
+    int prev = phase;
+
+    if (read_counters(now) == 0) {
+        for (int i = 0; i < PERF_NCOUNTERS; ++i) {
+            totals[phase][i] += now[i] - last[i];
+            last[i] = now[i];
+        }
+    }
+    nswitches++;
+    phase = next;
+    return prev;
+}
+
+/**
+* Function to print the counts of each phase per simulated event, and
+* close the counters
+*
+* @param nevents events the run handled
+*/
+void perf_report(long nevents) {
+    static const char *names[PERF_NPHASES] = { "simulator", "dequeue", "tolayer3", "callbacks" };
+    uint64_t sum[PERF_NCOUNTERS] = {0};
+    double per = nevents > 0 ? nevents : 1;
+    int p, i;
+
+    if (!perf_active) {
+        return;
+    }
+    perf_switch(phase);
+    perf_active = 0;
+    for (i = 0; i < PERF_NCOUNTERS; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+
+    printf(" Perf: user-space counts per event over %ld events, %ld phase changes\n", nevents, nswitches);
+    printf(" %-10s", "phase");
+    for (i = 0; i < PERF_NCOUNTERS; ++i) {
+        if (fds[i] >= 0) {
+            printf(" %14s", counters[i].name);
+        }
+    }
+    printf(" %6s\n", fds[0] >= 0 && fds[1] >= 0 ? "IPC" : "");
+    for (p = 0; p <= PERF_NPHASES; ++p) {
+        const uint64_t *c = p < PERF_NPHASES ? totals[p] : sum;
+        printf(" %-10s", p < PERF_NPHASES ? names[p] : "total");
+        for (i = 0; i < PERF_NCOUNTERS; ++i) {
+            if (fds[i] >= 0) {
+                printf(" %14.1f", c[i] / per);
+            }
+            if (p < PERF_NPHASES) {
+                sum[i] += c[i];
+            }
+        }
+        if (fds[0] >= 0 && fds[1] >= 0) {
+            printf(" %6.2f", c[0] > 0 ? (double)c[1] / c[0] : 0.0);
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,54 @@
+#include "../include/plugin.h"
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+* Protocol plugins.
+*
+* A plugin is a protocol source file built with -shared (see the Makefile)
+* that exports its entry points as proto_ops. It calls back into the
+* simulator API of the executable, which is linked with -rdynamic for it,
+* and binds its own globals (A_output, ...) to itself with -Bsymbolic, so
+* several plugins can be loaded into one process next to each other.
+*/
+
+/**
+* Function to load a protocol plugin
+*
+* @param path shared object; a bare name such as gbn or gbn.so is looked
+*             up as ./gbn.so first and then in the library search path
+* @return protocol table, or NULL on error
+*/
+const struct proto_ops *plugin_load(const char *path) {
+    const struct proto_ops *ops;
+    char *file;
+    void *handle;
+    size_t len = strlen(path);
+
+    if (strchr(path, '/') != NULL) {
+        handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    } else {
+        file = malloc(len + 6);
+        sprintf(file, "./%s%s", path,
+                len > 3 && strcmp(path + len - 3, ".so") == 0 ? "" : ".so");
+        handle = dlopen(file, RTLD_NOW | RTLD_LOCAL);
+        if (handle == NULL) {
+            handle = dlopen(file + 2, RTLD_NOW | RTLD_LOCAL);
+        }
+        free(file);
+    }
+    if (handle == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return NULL;
+    }
+
+    ops = dlsym(handle, "proto_ops");
+    if (ops == NULL) {
+        fprintf(stderr, "%s: not a protocol plugin (no proto_ops)\n", path);
+        dlclose(handle);
+        return NULL;
+    }
+    return ops;
+}
@@ -0,0 +1,113 @@
+#include "../include/profile.h"
+
+#ifdef SIM_PROFILE
+#include "../include/histogram.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+* Per-callback latency histograms.
+* Each call timed with PROFILE_BEGIN/PROFILE_END records its duration in
+* nanoseconds of CLOCK_MONOTONIC into the histogram of its site. Times
+* are inclusive: a tolayer3() called by A_output() counts in both. Every
+* thread records into histograms of its own, merged for the report, so
+* the parallel and wall-clock backends can be profiled too. Tracing with
+* -v prints from inside the callbacks, so profile with -v 0.
+*/
+
+static const char *names[PROF_NSITES] = {
+    "A_output", "A_input", "A_timerinterrupt", "B_input",
+    "insertevent", "tolayer3", "tolayer3_batch"
+};
+
+struct profile {
+    struct histogram sites[PROF_NSITES];
+    struct profile *next;
+};
+
+static struct profile *profiles = NULL;   /* one per thread that recorded */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct profile *self = NULL;
+
+/**
+* Function to read the clock the calls are timed with, in ns
+*/
+uint64_t profile_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+* Function to record a call that started at start
+*
+* @param site what was called
+* @param start profile_now() before the call
+*/
+void profile_record(int site, uint64_t start) {
+    uint64_t end = profile_now();
+
+    if (self == NULL) {
+        self = malloc(sizeof(struct profile));
+        for (int i = 0; i < PROF_NSITES; ++i) {
+            hist_init(&self->sites[i]);
+        }
+        pthread_mutex_lock(&lock);
+        self->next = profiles;
+        profiles = self;
+        pthread_mutex_unlock(&lock);
+    }
+    hist_record(&self->sites[site], end - start);
+}
+
+/**
+* Function to measure what timing a call adds to it, in ns
+*/
+static uint64_t overhead() {
+    uint64_t best = UINT64_MAX, t0, t1;
+
+    for (int i = 0; i < 1000; ++i) {
+        t0 = profile_now();
+        t1 = profile_now();
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+        }
+    }
+    return best;
+}
+
+/**
+* Function to print the histograms of all threads, merged, and start
+* over for the next run
+*/
+void profile_report() {
+    struct histogram total;
+    struct profile *p;
+
+    printf(" Profile: ns per call, inclusive, %llu ns of timing in each\n",
+           (unsigned long long)overhead());
+    printf(" %-18s %10s %10s %8s %8s %8s %10s %10s\n",
+           "call", "count", "mean", "p50", "p90", "p99", "max", "total ms");
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < PROF_NSITES; ++i) {
+        hist_init(&total);
+        for (p = profiles; p != NULL; p = p->next) {
+            hist_merge(&total, &p->sites[i]);
+            hist_init(&p->sites[i]);
+        }
+        if (total.count == 0) {
+            continue;
+        }
+        printf(" %-18s %10llu %10.1f %8llu %8llu %8llu %10llu %10.3f\n", names[i],
+               (unsigned long long)total.count, hist_mean(&total),
+               (unsigned long long)hist_percentile(&total, 50.0),
+               (unsigned long long)hist_percentile(&total, 90.0),
+               (unsigned long long)hist_percentile(&total, 99.0),
+               (unsigned long long)total.max, total.sum / 1e6);
+    }
+    pthread_mutex_unlock(&lock);
+}
+#endif
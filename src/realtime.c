@@ -0,0 +1,270 @@
+#include "../include/realtime.h"
+#include "../include/event.h"
+#include "../include/sampler.h"
+#include "../include/wallclock.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+* Real-time execution.
+*
+* The events are simulated as the main loop does, at their simulated
+* times, but no earlier than timeunit microseconds of wall clock per time
+* unit after the start. Between events the simulator sleeps in epoll_wait()
+* on a timerfd armed for the next one. Without input the results are those
+* of the simulation, only paced.
+*
+* With input, the messages of layer 5 are the lines read from a pipe, a
+* FIFO or standard input instead of the arrivals of the traffic model, the
+* first bytes of each line as the data. They arrive when they are read,
+* and go to the flows in turn. At the end of the input the run ends once
+* the senders have nothing unsent or unacknowledged left, DRAIN_LIMIT time
+* units later if a sender never gets there, or at -m messages as usual.
+*/
+
+#define LINE_MAX_LEN 4096
+#define DRAIN_LIMIT 1000.0
+
+static int inputfd = -1;            /* where messages come from, -1 for none */
+static int inputeof;
+static sim_ticks_t eoftime;         /* when the end of the input was read */
+static char line[LINE_MAX_LEN];     /* the part of a line read so far */
+static int linelen;
+static int nextflow;                /* flow the next input message goes to */
+
+static long nwakeups;
+static long nevents;                /* events run, and how late, in time units */
+static double sumlate, maxlate;
+static double wallsecs, cpusecs;
+
+/**
+* Function to open the input the messages come from
+*
+* @param filename pipe, FIFO or terminal, - for standard input
+* @return 0 on success, -1 on error
+*/
+int realtime_input(const char *filename) {
+    if (strcmp(filename, "-") == 0) {
+        inputfd = dup(STDIN_FILENO);
+    } else {
+        inputfd = open(filename, O_RDONLY);
+    }
+    if (inputfd < 0) {
+        perror(filename);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+* Function to give a line of input to the next flow as a message
+*/
+static void inputmessage() {
+    struct event *e = newevent();
+    int n = linelen < 20 ? linelen : 20;
+
+    for (int i = 0; i < nflows && flows[nextflow].done; ++i) {
+        nextflow = (nextflow + 1) % nflows;
+    }
+    e->evtime = wallclock_now() > simtime ? wallclock_now() : simtime;
+    e->evtype = FROM_LAYER5;
+    e->eventity = A;
+    e->flow = nextflow;
+    memset(e->pkt.payload, ' ', sizeof(e->pkt.payload));
+    memcpy(e->pkt.payload, line, n);
+    e->pktptr = &e->pkt;
+    e->timerid = -1;
+    insertevent(e);
+    nextflow = (nextflow + 1) % nflows;
+}
+
+/**
+* Function to read what the input has, a message per complete line
+*
+* @return 0 on success, -1 at the end of the input
+*/
+static int readinput() {
+    char buf[LINE_MAX_LEN];
+    ssize_t n;
+
+    if ((n = read(inputfd, buf, sizeof(buf))) <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return 0;
+        }
+        if (n < 0) {
+            perror("read");
+        }
+        return -1;
+    }
+    for (ssize_t i = 0; i < n; ++i) {
+        if (buf[i] == '\n') {
+            inputmessage();
+            linelen = 0;
+        } else if (linelen < LINE_MAX_LEN) {
+            line[linelen++] = buf[i];
+        }
+    }
+    return 0;
+}
+
+/**
+* Function to tell if the senders have all their messages acknowledged
+*/
+static int drained() {
+    struct proto_stats stats;
+    int saved = curflow;
+
+    for (curflow = 0; curflow < nflows; ++curflow) {
+        proto->get_stats(&stats);
+        if (!flows[curflow].done && (stats.snd_unsent > 0 || stats.snd_next != stats.snd_base)) {
+            break;
+        }
+    }
+    if (curflow < nflows) {
+        curflow = saved;
+        return 0;
+    }
+    curflow = saved;
+    return 1;
+}
+
+/**
+* Function to drop the arrivals of the traffic model from the queue
+*/
+static void droparrivals() {
+    struct event **kept = malloc(mainq.nevents * sizeof(struct event *));
+    struct event *e;
+    int n = 0;
+
+    while (mainq.nevents > 0) {
+        if ((e = removeevent())->evtype == FROM_LAYER5) {
+            freeevent(e);
+        } else {
+            kept[n++] = e;
+        }
+    }
+    while (n > 0) {
+        e = kept[--n];
+        if (e->evtype == FROM_LAYER3) {
+            mainq.ninflight[e->eventity]++;
+        }
+        heapinsert(e);
+    }
+    free(kept);
+}
+
+/**
+* Function to simulate the events on the main queue in wall-clock time
+*
+* @param timeunit wall-clock microseconds per time unit
+* @return 0 on success, -1 on error
+*/
+int realtime_run(double timeunit) {
+    struct epoll_event ev, ready[2];
+    struct event *e;
+    sim_ticks_t armed = -1, t;
+    uint64_t expirations;
+    double late;
+    int epfd, timer, i, n, nflowsdone = 0;
+
+    if ((epfd = epoll_create1(0)) < 0 || (timer = timerfd_create(CLOCK_MONOTONIC, 0)) < 0) {
+        perror("epoll");
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = timer;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, timer, &ev);
+    if (inputfd >= 0) {
+        ev.data.fd = inputfd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, inputfd, &ev) < 0) {
+            fprintf(stderr, "--input must be a pipe, a FIFO or a terminal\n");
+            close(timer);
+            close(epfd);
+            return -1;
+        }
+        fcntl(inputfd, F_SETFL, fcntl(inputfd, F_GETFL) | O_NONBLOCK);
+        droparrivals();
+        inputeof = 0;
+        linelen = 0;
+        nextflow = 0;
+    }
+
+    nwakeups = nevents = 0;
+    sumlate = maxlate = 0.0;
+    wallclock_start(timeunit);
+    while (nflowsdone < nflows && !(inputeof && (drained() || simtime >= eoftime + SIM_TICKS(DRAIN_LIMIT)))) {
+        // run what is due, late if the simulation cannot keep up
+        t = wallclock_now();
+        while ((e = nextevent()) != NULL && e->evtime <= t) {
+            late = SIM_UNITS(t - e->evtime);
+            nevents++;
+            sumlate += late;
+            if (late > maxlate) {
+                maxlate = late;
+            }
+            sampler_advance(e->evtime);
+            if (handleevent(removeevent()) && ++nflowsdone == nflows) {
+                break;
+            }
+        }
+        if (nflowsdone == nflows) {
+            break;
+        }
+        if (e == NULL && (inputfd < 0 || inputeof)) {
+            break;
+        }
+
+        // sleep until the next event or input
+        if (e == NULL || e->evtime != armed) {
+            wallclock_arm(timer, e != NULL ? e->evtime : -1);
+            armed = e != NULL ? e->evtime : -1;
+        }
+        if ((n = epoll_wait(epfd, ready, 2, -1)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        nwakeups++;
+        for (i = 0; i < n; ++i) {
+            if (ready[i].data.fd == timer) {
+                if (read(timer, &expirations, sizeof(expirations)) > 0) {
+                    armed = -1;
+                }
+            } else if (readinput() < 0) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, inputfd, NULL);
+                inputeof = 1;
+                eoftime = wallclock_now();
+            }
+        }
+    }
+    wallclock_stop(&wallsecs, &cpusecs);
+    close(timer);
+    close(epfd);
+    return 0;
+}
+
+/**
+* Function to report the pacing of the last real-time run
+*
+* @param ndelivered messages delivered to layer 5
+*/
+void realtime_printstats(int ndelivered) {
+    printf(" Real time: %ld wakeups, events %f time units late on average, %f at most\n",
+           nwakeups, nevents > 0 ? sumlate / nevents : 0.0, maxlate);
+    printf(" Real time: %f s wall clock, %f s CPU", wallsecs, cpusecs);
+    if (ndelivered > 0) {
+        printf(", %f us CPU and %f wakeups per delivered message",
+               cpusecs * 1e6 / ndelivered, (double)nwakeups / ndelivered);
+    }
+    printf("\n");
+}
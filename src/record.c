@@ -0,0 +1,210 @@
+#include "../include/record.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+* Record and replay of the random decisions of the emulator.
+*
+* Record mode logs the fate of every packet entering the medium and every
+* message inter-arrival gap. Replay mode feeds them back: the k-th packet
+* sent by an entity gets the k-th decision recorded for that entity, and
+* the k-th message the k-th gap, whatever else the protocol does. Packets
+* and messages past the end of the recording are drawn as usual.
+*
+* File layout after the header, one record per decision in the order
+* they were made:
+*   'M' gap(double)                          message arrival
+*   'A'/'B' flags(byte) [delay(float)]       packet sent by A or B
+* where flags holds lost (bit 0), reordered (bit 1) and the corruption
+* kind (bits 2-3); lost packets have no delay.
+*/
+
+#define RECORD_MAGIC "TLSIMREC"
+
+#define FLAG_LOST      0x1
+#define FLAG_REORDERED 0x2
+#define CORRUPT_SHIFT  2
+
+static FILE *recfp = NULL;
+
+/* replayed decisions, per sending entity */
+static struct chan_decision *decisions[2];
+static int ndecisions[2];
+static int nreplayed[2];
+static int nlive[2];
+static double *gaps = NULL;
+static int ngaps;
+static int ngapsreplayed;
+static int replaying;
+
+/**
+* Function to start recording
+*
+* @param filename file to write the decisions to
+* @return 0 on success, -1 on error
+*/
+int record_open(const char *filename) {
+    recfp = fopen(filename, "wb");
+    if (recfp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    fwrite(RECORD_MAGIC, 8, 1, recfp);
+    return 0;
+}
+
+/**
+* Function to make room for one more element at the end of an array
+* that starts at 64 elements and doubles when full
+*
+* @param count elements already in the array
+*/
+static void *grow(void *array, int count, int size) {
+    if (count == 0) {
+        array = realloc(array, 64 * size);
+    } else if (count >= 64 && (count & (count - 1)) == 0) {
+        array = realloc(array, 2 * count * size);
+    }
+    return array;
+}
+
+/**
+* Function to load a recording for replay
+*
+* @param filename file written by a recording run
+* @return 0 on success, -1 on error
+*/
+int replay_open(const char *filename) {
+    FILE *fp;
+    char magic[8];
+    int tag, flags, who;
+    struct chan_decision d;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    if (fread(magic, 8, 1, fp) != 1 || memcmp(magic, RECORD_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a channel recording\n", filename);
+        fclose(fp);
+        return -1;
+    }
+
+    while ((tag = getc(fp)) != EOF) {
+        if (tag == 'M') {
+            gaps = grow(gaps, ngaps, sizeof(double));
+            if (fread(&gaps[ngaps], sizeof(double), 1, fp) != 1) {
+                break;
+            }
+            ngaps++;
+        } else if (tag == 'A' || tag == 'B') {
+            who = tag - 'A';
+            if ((flags = getc(fp)) == EOF) {
+                break;
+            }
+            memset(&d, 0, sizeof(d));
+            d.lost = flags & FLAG_LOST;
+            d.reordered = (flags & FLAG_REORDERED) != 0;
+            d.corrupt = (flags >> CORRUPT_SHIFT) & 0x3;
+            if (!d.lost && fread(&d.delay, sizeof(float), 1, fp) != 1) {
+                break;
+            }
+            decisions[who] = grow(decisions[who], ndecisions[who], sizeof(struct chan_decision));
+            decisions[who][ndecisions[who]++] = d;
+        } else {
+            fprintf(stderr, "%s: corrupt channel recording\n", filename);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    replaying = 1;
+    return 0;
+}
+
+/**
+* Function to start a replay over from its first decision, for the next run
+*/
+void replay_rewind() {
+    nreplayed[0] = nreplayed[1] = 0;
+    nlive[0] = nlive[1] = 0;
+    ngapsreplayed = 0;
+}
+
+/**
+* Function to get the recorded fate of the next packet sent by AorB
+*
+* @return 1 if *d was filled from the recording, 0 if it ran out
+*/
+int replay_packet(int AorB, struct chan_decision *d) {
+    int k;
+
+    if (!replaying) {
+        return 0;
+    }
+    k = nreplayed[AorB] + nlive[AorB];
+    if (k >= ndecisions[AorB]) {
+        nlive[AorB]++;
+        return 0;
+    }
+    *d = decisions[AorB][k];
+    nreplayed[AorB]++;
+    return 1;
+}
+
+void record_packet(int AorB, const struct chan_decision *d) {
+    if (recfp == NULL) {
+        return;
+    }
+    putc('A' + AorB, recfp);
+    putc((d->lost ? FLAG_LOST : 0) | (d->reordered ? FLAG_REORDERED : 0)
+         | (d->corrupt << CORRUPT_SHIFT), recfp);
+    if (!d->lost) {
+        fwrite(&d->delay, sizeof(float), 1, recfp);
+    }
+}
+
+/**
+* Function to get the recorded gap before the next message arrival
+*
+* @return 1 if *gap was filled from the recording, 0 if it ran out
+*/
+int replay_arrival(double *gap) {
+    if (!replaying || ngapsreplayed >= ngaps) {
+        return 0;
+    }
+    *gap = gaps[ngapsreplayed++];
+    return 1;
+}
+
+void record_arrival(double gap) {
+    if (recfp == NULL) {
+        return;
+    }
+    putc('M', recfp);
+    fwrite(&gap, sizeof(double), 1, recfp);
+}
+
+int record_active() {
+    return recfp != NULL;
+}
+
+int replay_active() {
+    return replaying;
+}
+
+/**
+* Function to finish recording and report how much of a replay was used
+*/
+void record_close() {
+    if (recfp != NULL) {
+        fclose(recfp);
+        recfp = NULL;
+    }
+    if (replaying) {
+        printf(" Replayed %d of %d msg gaps, %d+%d packet decisions (%d+%d drawn live)\n",
+               ngapsreplayed, ngaps, nreplayed[0], nreplayed[1], nlive[0], nlive[1]);
+    }
+}
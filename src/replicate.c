@@ -0,0 +1,300 @@
+#include "../include/replicate.h"
+#include "../include/metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+* Confidence intervals for throughput and latency.
+*
+* Replications run the simulation again with seeds one apart, each in a
+* process of its own, jobs at a time. The estimate only ever takes the
+* runs of the first seeds in order, so the result does not depend on
+* which process finishes first. It stops launching runs once both 95%
+* confidence intervals are within precision of their means, and kills
+* those still running.
+*
+* Batch means cut a single run into batches of simulated time, the first
+* one dropped as the warm-up, and take the throughput and mean latency of
+* each batch as one observation. The run stops at the end of the batch
+* after which both intervals are within precision, from MIN_BATCHES on.
+* Batches of a run are correlated if they are short compared with the
+* timeouts and queueing delays, so make them long.
+*/
+
+#define MIN_RUNS 3
+#define MIN_BATCHES 10
+
+/* running mean and variance, Welford's method */
+struct estimate {
+    int n;
+    double mean;
+    double m2;
+};
+
+/**
+* Function to add an observation to an estimate
+*
+* @param e estimate
+* @param x observation
+*/
+static void observe(struct estimate *e, double x) {
+    double delta = x - e->mean;
+
+    e->n++;
+    e->mean += delta / e->n;
+    e->m2 += delta * (x - e->mean);
+}
+
+/**
+* Function to get the half width of the 95% confidence interval of the
+* mean, with the quantiles of Student's t distribution
+*
+* @param e estimate, of 2 observations or more
+*/
+static double halfwidth(const struct estimate *e) {
+    static const double t95[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    int df = e->n - 1;
+    // close to the table beyond 30 degrees of freedom
+    double t = df <= 30 ? t95[df - 1] : 1.960 + 2.5 / df;
+
+    return t * sqrt(e->m2 / df / e->n);
+}
+
+/**
+* Function to tell if an interval is within precision of its mean
+*
+* @param e estimate
+* @param precision largest half width, relative to the mean
+*/
+static int precise(const struct estimate *e, double precision) {
+    return e->n >= 2 && halfwidth(e) <= precision * fabs(e->mean);
+}
+
+/**
+* Function to print an estimate with its interval
+*
+* @param what what is estimated
+* @param unit unit of the mean
+* @param e estimate
+*/
+static void print_estimate(const char *what, const char *unit, const struct estimate *e) {
+    if (e->n < 2) {
+        printf(" %s: %s\n", what, e->n ? "one observation, no interval" : "no observations");
+        return;
+    }
+    printf(" %s: mean %f %s, 95%% CI +/- %f (%.2f%%) over %d\n", what, e->mean, unit,
+           halfwidth(e), e->mean != 0.0 ? 100.0 * halfwidth(e) / fabs(e->mean) : 0.0, e->n);
+}
+
+/**
+* Function run by the process of a replication: run it with the output
+* of the simulation thrown away, and send back what it measured
+*
+* @param run the replication
+* @param index its number
+* @param fd where to write the result
+*/
+static void child(replicate_fn run, int index, int fd) {
+    struct replicate_result result;
+    int null = open("/dev/null", O_WRONLY);
+
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    if (run(index, &result) < 0) {
+        _exit(1);
+    }
+    fflush(stdout);
+    // small enough to be written at once
+    if (write(fd, &result, sizeof(result)) != sizeof(result)) {
+        _exit(1);
+    }
+    _exit(0);
+}
+
+/**
+* Function to run replications until the intervals are precise enough
+*
+* @param run runs replication index, from 0, and fills in its result
+* @param maxruns most replications to run
+* @param jobs most replications running at a time
+* @param precision relative half width to stop at, 0 to run them all
+* @return 0 on success, -1 if a replication failed
+*/
+int replicate_run(replicate_fn run, int maxruns, int jobs, double precision) {
+    struct replicate_result *results = calloc(maxruns, sizeof(struct replicate_result));
+    pid_t *pids = calloc(maxruns, sizeof(pid_t));
+    int *fds = calloc(maxruns, sizeof(int));
+    char *done = calloc(maxruns, 1);
+    struct estimate throughput = {0}, latency = {0};
+    int next = 0, nused = 0, nrunning = 0, stop = 0, failed = 0, reached = 0;
+    int i, status, p[2];
+    pid_t pid;
+
+    while (nrunning > 0 || (!stop && next < maxruns)) {
+        // keep jobs replications going
+        while (!stop && next < maxruns && nrunning < jobs) {
+            fflush(stdout);
+            if (pipe(p) < 0 || (pid = fork()) < 0) {
+                perror("replication");
+                stop = failed = 1;
+                break;
+            }
+            if (pid == 0) {
+                close(p[0]);
+                child(run, next, p[1]);
+            }
+            close(p[1]);
+            pids[next] = pid;
+            fds[next++] = p[0];
+            nrunning++;
+        }
+        if (nrunning == 0) {
+            break;
+        }
+
+        // collect one that finished
+        if ((pid = wait(&status)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wait");
+            break;
+        }
+        for (i = 0; i < next && pids[i] != pid; ++i) {
+        }
+        if (i == next) {
+            continue;
+        }
+        nrunning--;
+        pids[i] = 0;
+        if (!stop && (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+                      read(fds[i], &results[i], sizeof(results[i])) != sizeof(results[i]))) {
+            fprintf(stderr, "Replication %d failed\n", i + 1);
+            stop = failed = 1;
+        }
+        close(fds[i]);
+        done[i] = 1;
+
+        // the runs of the first seeds, in order, make the estimate
+        while (!stop && nused < next && done[nused]) {
+            printf(" replication %d: throughput %f, latency %f\n", nused + 1,
+                   results[nused].throughput, results[nused].latency);
+            observe(&throughput, results[nused].throughput);
+            if (results[nused].latency >= 0.0) {
+                observe(&latency, results[nused].latency);
+            }
+            nused++;
+            if (precision > 0.0 && nused >= MIN_RUNS &&
+                precise(&throughput, precision) && precise(&latency, precision)) {
+                stop = reached = 1;
+            }
+        }
+        if (stop) {
+            // what is still running is not needed any more
+            for (i = 0; i < next; ++i) {
+                if (pids[i] > 0) {
+                    kill(pids[i], SIGKILL);
+                }
+            }
+        }
+    }
+
+    if (!failed) {
+        printf(" Replications: %d used, %d started, at most %d, %d at a time\n",
+               nused, next, maxruns, jobs);
+        print_estimate("Throughput", "packets/time unit", &throughput);
+        print_estimate("Latency", "time units", &latency);
+        if (precision > 0.0) {
+            printf(" Precision of %.2f%% %s\n", 100.0 * precision,
+                   reached ? "reached" : "not reached, at the last replication");
+        }
+    }
+    free(results);
+    free(pids);
+    free(fds);
+    free(done);
+    return failed ? -1 : 0;
+}
+
+/* batch means state */
+static sim_ticks_t batchlen;
+static sim_ticks_t batchend;
+static double batchprecision;
+static int nbatches;               /* batches ended so far, with the warm-up */
+static int lastdelivered;          /* totals at the start of the batch */
+static double lastlatency;
+static struct estimate batchthroughput, batchlatency;
+static int batchstopped;
+
+/**
+* Function to start batch means for a run
+*
+* @param length simulated time of a batch
+* @param precision relative half width to stop at, 0 to run to the end
+*/
+void batch_open(double length, double precision) {
+    batchlen = SIM_TICKS(length);
+    batchend = get_sim_ticks() + batchlen;
+    batchprecision = precision;
+    nbatches = 0;
+    metrics_totals(&lastdelivered, &lastlatency);
+    memset(&batchthroughput, 0, sizeof(batchthroughput));
+    memset(&batchlatency, 0, sizeof(batchlatency));
+    batchstopped = 0;
+}
+
+/**
+* Function to end the batches that are over before an event at now
+*
+* @param now time of the next event
+* @return 1 if the intervals are precise enough to stop the run
+*/
+int batch_advance(sim_ticks_t now) {
+    int delivered;
+    double latency;
+
+    while (now >= batchend) {
+        metrics_totals(&delivered, &latency);
+        // the first batch is the warm-up
+        if (nbatches++ > 0) {
+            observe(&batchthroughput, (delivered - lastdelivered) / SIM_UNITS(batchlen));
+            if (delivered > lastdelivered) {
+                observe(&batchlatency, (latency - lastlatency) / (delivered - lastdelivered));
+            }
+        }
+        lastdelivered = delivered;
+        lastlatency = latency;
+        batchend += batchlen;
+        if (batchprecision > 0.0 && batchthroughput.n >= MIN_BATCHES &&
+            precise(&batchthroughput, batchprecision) && precise(&batchlatency, batchprecision)) {
+            batchstopped = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+* Function to print the batch means of the run
+*/
+void batch_report() {
+    printf(" Batch means: %d batches of %f time units after the warm-up\n",
+           batchthroughput.n, SIM_UNITS(batchlen));
+    print_estimate("Throughput", "packets/time unit", &batchthroughput);
+    print_estimate("Latency", "time units", &batchlatency);
+    if (batchprecision > 0.0) {
+        printf(" Precision of %.2f%% %s\n", 100.0 * batchprecision,
+               batchstopped ? "reached, run stopped early" : "not reached");
+    }
+}
@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include "../include/ring.h"
+#include "../include/event.h"
+#include "../include/wallclock.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/**
+* Shared-memory ring backend.
+*
+* A and B each get a thread, and pass packets to each other through two
+* single-producer single-consumer rings in shared memory, one for each
+* direction, with no system calls and no locks on the rings. The sender
+* puts each packet through the losses and corruption of the medium before
+* it goes on the ring, see impairpacket(). The rings have no link and no
+* delay: a packet can be read as soon as it is written, and a packet that
+* finds its ring full is lost, after it is counted as sent.
+*
+* Time is the wall clock, timeunit microseconds to a time unit, for the
+* message arrivals and the timers, which each thread keeps in an event
+* queue of its own. The threads spin on their ring and their next event,
+* and yield the CPU while both are idle. The CPU time they spend idle is
+* kept apart, so that the CPU per delivered message is what the protocol
+* and the rings cost, polling left out.
+*
+* The counters and metrics of the simulator are shared, so the threads run
+* the protocol callbacks under one lock, taken once for a batch of packets.
+*/
+
+#define RING_SIZE 4096     /* packets per ring, a power of 2 */
+#define RING_BATCH 64      /* packets read from a ring at a time */
+#define CACHELINE 64
+
+struct slot {
+    int flow;
+    struct pkt packet;
+};
+
+/* the producer and the consumer each write only their own index, on a
+   cache line of its own, and keep a copy of the other one */
+struct ring {
+    _Atomic unsigned long tail __attribute__((aligned(CACHELINE)));   /* next slot written */
+    _Atomic unsigned long head __attribute__((aligned(CACHELINE)));   /* next slot read */
+    struct slot slots[RING_SIZE] __attribute__((aligned(CACHELINE)));
+};
+
+struct endpoint {
+    pthread_t thread;
+    struct ring *rx;       /* packets for this entity */
+    struct ring *tx;       /* packets from it */
+    unsigned long tail;    /* slots written to tx, not yet published */
+    unsigned long head;    /* head of tx, as last read */
+    struct evqueue queue;
+    long nsent;            /* packets and batches, for the report */
+    long noverflow;
+    long nreceived;
+    long nbatches;
+    long nyields;
+    int idle;              /* polling since idlestart, in thread CPU time */
+    double idlestart;
+    double idlesecs;       /* thread CPU time spent polling */
+};
+
+static struct ring *rings;          /* A to B, then B to A */
+static struct endpoint endpoints[2];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int stopping;
+static int nflowsdone;
+static double wallsecs, cpusecs;
+
+/* the endpoint the calling thread is, NULL in the main thread */
+static __thread struct endpoint *self = NULL;
+
+/**
+* Function to put packets handed to layer 3 by an endpoint thread on its
+* ring, after the medium had its way with them
+*
+* @param AorB sending entity
+* @param pkts packets to send, in order
+* @param n number of packets
+* @return 1 if sent, 0 if the caller is not an endpoint thread
+*/
+int ring_send(int AorB, const struct pkt *pkts, int n) {
+    struct ring *r;
+    struct slot *s;
+    struct pkt copy;
+
+    if (self == NULL) {
+        return 0;
+    }
+    r = self->tx;
+    for (int i = 0; i < n; ++i) {
+        // sent, and counted as sent, whether or not there is room for it
+        if (!impairpacket(AorB, &pkts[i], &copy)) {
+            continue;
+        }
+        if (self->tail - self->head == RING_SIZE) {
+            self->head = atomic_load_explicit(&r->head, memory_order_acquire);
+            if (self->tail - self->head == RING_SIZE) {
+                self->noverflow++;
+                continue;
+            }
+        }
+        s = &r->slots[self->tail % RING_SIZE];
+        s->packet = copy;
+        s->flow = curflow;
+        self->tail++;
+        self->nsent++;
+    }
+    return 1;
+}
+
+/**
+* Function to make the packets written to the ring of the calling thread
+* visible to the other side
+*/
+static void publish() {
+    atomic_store_explicit(&self->tx->tail, self->tail, memory_order_release);
+}
+
+/**
+* Function to read the packets waiting on the ring of the calling thread
+*
+* @param in where to copy them
+* @return number of packets read, at most RING_BATCH
+*/
+static int receive(struct slot *in) {
+    struct ring *r = self->rx;
+    unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned long tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    int n = tail - head < RING_BATCH ? tail - head : RING_BATCH;
+
+    for (int i = 0; i < n; ++i) {
+        in[i] = r->slots[(head + i) % RING_SIZE];
+    }
+    atomic_store_explicit(&r->head, head + n, memory_order_release);
+    return n;
+}
+
+/**
+* Function to handle an event of an endpoint, and end the run with the
+* last flow
+*
+* @param e event, freed
+*/
+static void handle(struct event *e) {
+    if (handleevent(e) && ++nflowsdone == nflows) {
+        atomic_store(&stopping, 1);
+    }
+}
+
+/**
+* Function to run what is due at A or B: its arrivals and timers, then
+* the packets just read
+*
+* @param in packets read
+* @param n number of packets
+* @param t current time
+*/
+static void due(struct slot *in, int n, sim_ticks_t t) {
+    struct event *e;
+
+    while (!stopping && (e = nextevent()) != NULL && e->evtime <= t) {
+        handle(removeevent());
+    }
+    for (int i = 0; i < n && !stopping; ++i) {
+        e = newevent();
+        e->evtime = t;
+        e->evtype = FROM_LAYER3;
+        e->eventity = self - endpoints;
+        e->flow = in[i].flow;
+        e->pkt = in[i].packet;
+        e->pktptr = &e->pkt;
+        e->timerid = -1;
+        e->seq = 0;
+        handle(e);
+    }
+}
+
+/**
+* Function run by the thread of each endpoint
+*
+* @param arg its struct endpoint
+*/
+static void *run(void *arg) {
+    struct slot in[RING_BATCH];
+    struct event *e;
+    sim_ticks_t t;
+    int n;
+
+    self = arg;
+    evq = &self->queue;
+    while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+        n = receive(in);
+        t = wallclock_now();
+        if (n == 0 && ((e = nextevent()) == NULL || e->evtime > t)) {
+            // let the other side run when there is one CPU for both
+            if (!self->idle) {
+                self->idle = 1;
+                self->idlestart = wallclock_threadcpu();
+            }
+            self->nyields++;
+            sched_yield();
+            continue;
+        }
+        if (self->idle) {
+            self->idle = 0;
+            self->idlesecs += wallclock_threadcpu() - self->idlestart;
+        }
+        self->nreceived += n;
+        self->nbatches++;
+        pthread_mutex_lock(&lock);
+        if (!stopping) {
+            due(in, n, t);
+        }
+        pthread_mutex_unlock(&lock);
+        publish();
+    }
+    if (self->idle) {
+        self->idlesecs += wallclock_threadcpu() - self->idlestart;
+    }
+    return NULL;
+}
+
+/**
+* Function to run the simulation over shared-memory rings, from the events
+* on the main queue
+*
+* @param timeunit wall-clock microseconds per time unit
+* @return 0 on success, -1 on error
+*/
+int ring_run(double timeunit) {
+    struct event *e;
+    int i, err;
+
+    // shared, so the rings would work between processes as well
+    rings = mmap(NULL, 2 * sizeof(struct ring), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (rings == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    memset(endpoints, 0, sizeof(endpoints));
+    for (i = 0; i < 2; ++i) {
+        endpoints[i].tx = &rings[i];
+        endpoints[i].rx = &rings[1 - i];
+    }
+
+    // the first arrivals and timers go to the entity they are for
+    while (mainq.nevents > 0) {
+        e = removeevent();
+        evq = &endpoints[e->eventity].queue;
+        if (e->evtype == FROM_LAYER3) {
+            evq->ninflight[e->eventity]++;
+        }
+        heapinsert(e);
+        evq = &mainq;
+    }
+
+    atomic_store(&stopping, 0);
+    nflowsdone = 0;
+    wallclock_start(timeunit);
+    for (i = 0; i < 2; ++i) {
+        if ((err = pthread_create(&endpoints[i].thread, NULL, run, &endpoints[i])) != 0) {
+            fprintf(stderr, "Cannot start endpoint thread: %s\n", strerror(err));
+            exit(-1);
+        }
+    }
+    for (i = 0; i < 2; ++i) {
+        pthread_join(endpoints[i].thread, NULL);
+    }
+    wallclock_stop(&wallsecs, &cpusecs);
+
+    // the run ends when the last flow stops
+    simtime = 0;
+    for (i = 0; i < nflows; ++i) {
+        if (flows[i].stoptime > simtime) {
+            simtime = flows[i].stoptime;
+        }
+    }
+
+    for (i = 0; i < 2; ++i) {
+        evq = &endpoints[i].queue;
+        while (evq->nevents > 0) {
+            freeevent(removeevent());
+        }
+        while ((e = evq->pool) != NULL) {
+            evq->pool = e->nextfree;
+            free(e);
+        }
+        free(evq->heap);
+    }
+    evq = &mainq;
+    munmap(rings, 2 * sizeof(struct ring));
+    return 0;
+}
+
+/**
+* Function to report the packets of the last run over the rings
+*
+* @param ndelivered messages delivered to layer 5
+*/
+void ring_printstats(int ndelivered) {
+    long nsent = 0, noverflow = 0, nreceived = 0, nbatches = 0, nyields = 0;
+    double idlesecs = 0.0;
+
+    for (int i = 0; i < 2; ++i) {
+        idlesecs += endpoints[i].idlesecs;
+        nsent += endpoints[i].nsent;
+        noverflow += endpoints[i].noverflow;
+        nreceived += endpoints[i].nreceived;
+        nbatches += endpoints[i].nbatches;
+        nyields += endpoints[i].nyields;
+    }
+    printf(" Ring: %ld packets sent, %ld lost to full rings, %ld received in %ld batches, %ld idle yields\n",
+           nsent, noverflow, nreceived, nbatches, nyields);
+    printf(" Ring: %f s wall clock, %f s CPU of which %f s polling idle, %f packets per second",
+           wallsecs, cpusecs, idlesecs, wallsecs > 0.0 ? nreceived / wallsecs : 0.0);
+    if (ndelivered > 0) {
+        printf(", %f us busy CPU per delivered message", (cpusecs - idlesecs) * 1e6 / ndelivered);
+    }
+    printf("\n");
+}
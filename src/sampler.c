@@ -0,0 +1,99 @@
+#include "../include/sampler.h"
+#include "../include/event.h"
+#include <stdio.h>
+#include <string.h>
+
+/**
+* Time-series sampler.
+* Writes one CSV row per sample interval of simulated time with the event
+* list length, packets in flight in each direction, the sender window and
+* receiver buffer occupancy (summed over the flows) and the cumulative
+* transmissions and deliveries. Nothing changes between two events, so
+* the rows due before an event are written right before the event is
+* handled.
+*/
+
+extern int A_transport;
+extern int B_application;
+
+static FILE *fp = NULL;
+static sim_ticks_t step;
+static long nsamples;
+
+/**
+* Function to start sampling
+*
+* @param filename CSV file to write, - for stdout
+* @param interval simulated time between samples
+* @return 0 on success, -1 if the file could not be opened
+*/
+int sampler_open(const char *filename, double interval) {
+    fp = strcmp(filename, "-") ? fopen(filename, "w") : stdout;
+    if (fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    step = SIM_TICKS(interval);
+
+    // a restored run starts sampling where it left off
+    nsamples = (get_sim_ticks() + step - 1) / step;
+    fprintf(fp, "time,events,inflight_ab,inflight_ba,snd_base,snd_next,window,snd_unsent,rcv_buffered,sent,delivered\n");
+    return 0;
+}
+
+/**
+* Function to write a row with the current state
+*
+* @param at sample time
+*/
+static void sample(sim_ticks_t at) {
+    struct proto_stats stats, flow;
+    int current = curflow;
+
+    // totals over the flows
+    memset(&stats, 0, sizeof(stats));
+    for (curflow = 0; curflow < nflows; ++curflow) {
+        proto->get_stats(&flow);
+        stats.snd_base += flow.snd_base;
+        stats.snd_next += flow.snd_next;
+        stats.snd_unsent += flow.snd_unsent;
+        stats.rcv_buffered += flow.rcv_buffered;
+    }
+    curflow = current;
+    fprintf(fp, "%f,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d\n", SIM_UNITS(at), evq->nevents,
+            evq->ninflight[1], evq->ninflight[0], stats.snd_base, stats.snd_next,
+            stats.snd_next - stats.snd_base, stats.snd_unsent,
+            stats.rcv_buffered, A_transport, B_application);
+}
+
+/**
+* Function to write all the samples due up to the next event
+*
+* @param now time of the event about to be handled
+*/
+void sampler_advance(sim_ticks_t now) {
+    if (fp == NULL) {
+        return;
+    }
+    while (nsamples * step <= now) {
+        sample(nsamples * step);
+        ++nsamples;
+    }
+}
+
+/**
+* Function to write a final row and close the file
+*
+* @param now time the simulation stopped
+*/
+void sampler_close(sim_ticks_t now) {
+    if (fp == NULL) {
+        return;
+    }
+    sampler_advance(now);
+    sample(now);
+    if (fp != stdout) {
+        fclose(fp);
+    }
+    fp = NULL;
+}
@@ -2,8 +2,27 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "../include/simulator.h"
+#include "../include/event.h"
+#include "../include/metrics.h"
+#include "../include/sampler.h"
+#include "../include/snapshot.h"
+#include "../include/record.h"
+#include "../include/plugin.h"
+#include "../include/parallel.h"
+#include "../include/traffic.h"
+#include "../include/udp.h"
+#include "../include/ring.h"
+#include "../include/realtime.h"
+#include "../include/profile.h"
+#include "../include/perf.h"
+#include "../include/replicate.h"
+#include "../include/cache.h"
+#include "../include/fec.h"
+#include "../include/aggregate.h"
 
 /* Statistics */
 int A_application = 0;
@@ -12,6 +31,11 @@ int B_application = 0;
 int B_transport = 0;
 
 int win_size;
+static int seqbits = 31;          /* width of the protocols' sequence numbers */
+
+/* protocol linked into this binary, if any */
+extern const struct proto_ops proto_ops __attribute__((weak));
+const struct proto_ops *proto = NULL;
 
 /*****************************************************************
 ***************** NETWORK EMULATION CODE STARTS BELOW ***********
@@ -29,41 +53,111 @@ the emulator, you're welcome to look at the code - but again, you should have
 to, and you defeinitely should not have to modify
 ******************************************************************/
 
-struct event {
-   float evtime;           /* event time */
-   int evtype;             /* event type code */
-   int eventity;           /* entity where event occurs */
-   struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
-   struct event *prev;
-   struct event *next;
- };
-struct event *evlist = NULL;   /* the event list */
+struct evqueue mainq;          /* the event heap, see insertevent() */
+__thread struct evqueue *evq = &mainq;
+char randstate[2][128];        /* rand() state, see init() and sim_restore() */
+char *randactive = randstate[0];
+long nprocessed = 0;           /* events handled by the main loop */
 
 //forward declarations
 void init();
+static struct event **timerslot();
+static void transmit();
+static void fecdeliver();
+static void aggflush();
+static void printskipped();
+static void scheduletimeout();
 void generate_next_arrival();
-void insertevent(struct event*);
-
-/* possible events: */
-#define  TIMER_INTERRUPT 0  
-#define  FROM_LAYER5     1
-#define  FROM_LAYER3     2
+void schedulearrival();
+void printlinkstats();
+float simrand();
 
 #define  OFF             0
 #define  ON              1
-#define   A    0
-#define   B    1
 
 int TRACE = 1;             /* for my debugging */
 int nsim = 0;              /* number of messages from 5 to 4 so far */ 
 int nsimmax = 0;           /* number of msgs to generate, then stop */
-float time = 0.000;
+__thread sim_ticks_t simtime = 0; /* current time in ticks */
 float lossprob = 0.0;	   /* probability that a packet is dropped */
 float corruptprob = 0.0;   /* probability that one bit is packet is flipped */
 float lambda = 0.0; 	   /* arrival rate of messages from layer 5 */
 int ntolayer3 = 0; 	   /* number sent into layer 3 */
 int nlost = 0; 	  	   /* number lost in media */
 int ncorrupt = 0; 	   /* number corrupted by media*/
+float reorderprob = 0.0;   /* probability that a packet skips the FIFO order */
+float reordermax = 10.0;   /* max extra delay of a reordered packet */
+int nreordered = 0;        /* number reordered by media */
+
+/* the frame each entity's packets go in with --aggregate, see aggregate.c */
+static int framelen[2];                   /* packets in it so far */
+static struct chan_decision framedecision[2];
+static sim_ticks_t framearrival[2];       /* when its last packet arrives */
+static int frameflow;                     /* flow they are of */
+
+/* sender/receiver pairs, see struct flow */
+#define STOP_EVENT   -1        /* accountevent() for the event stopping a flow */
+#define FEC_PARITY   4         /* accountevent() for a parity packet arriving */
+struct flow *flows = NULL;
+int nflows = 1;
+__thread int curflow = 0;      /* flow of the event being handled */
+
+/* bottleneck link in front of the medium, one per direction (indexed by
+   the sending entity).  Packets are sent at linkrate packets per time unit
+   from a FIFO queue of at most queuelimit packets (including the one being
+   sent); a full queue drops the packet, and RED may drop it earlier */
+struct link {
+   sim_ticks_t busy_until; /* time the last queued packet leaves the link */
+   sim_ticks_t *departures; /* ring of departure times of queued packets */
+   int head;               /* oldest entry in departures */
+   int count;              /* packets queued or being sent */
+   float red_avg;          /* RED average queue length */
+   int red_count;          /* packets admitted since the last RED drop */
+   int npassed;            /* packets admitted to the queue */
+   int ntaildrop;          /* dropped because the queue was full */
+   int nearlydrop;         /* dropped by RED */
+   int maxqueue;           /* largest occupancy seen on admission */
+   double sojourn;         /* sum of queueing + sending time, for the mean */
+ };
+struct link links[2];
+float linkrate = 0.0;      /* packets per time unit, 0 for unlimited */
+int queuelimit = 64;       /* link buffer size in packets */
+int red = 0;               /* RED queue management instead of tail drop */
+float red_minth = 5.0;     /* RED thresholds on the average queue length */
+float red_maxth = 15.0;
+float red_maxp = 0.1;      /* RED drop probability at red_maxth */
+float red_weight = 0.002;  /* RED averaging weight */
+
+/* run options, see display_usage() */
+static int seed;
+static char *metricsfile = NULL;
+static int nmetrics = 0;          /* runs written to metricsfile so far */
+static char *samplefile = NULL;
+static float sampleinterval = 100.0;
+static char *snapshotfile = NULL;
+static sim_ticks_t snapshotat = 0;
+static char *restorefile = NULL;
+static int nthreads = 0;          /* parallel workers, 0 to run sequentially */
+static int udp = 0;               /* run over loopback UDP, see udp.c */
+static int ring = 0;              /* run over shared-memory rings, see ring.c */
+static int realtime = 0;          /* pace the simulation, see realtime.c */
+static int input = 0;             /* messages come from --input */
+static int traffic = 0;           /* a --traffic model was given */
+static int perf = 0;              /* hardware counters, see perf.c */
+static int nreplications = 0;     /* most runs with seeds one apart, see replicate.c */
+static int njobs = 0;             /* replications at a time, 0 for one per CPU */
+static float batchlength = 0.0;   /* batch means in batches of this length */
+static float precision = 0.05;    /* confidence interval width to stop at */
+static char *cachedir = NULL;     /* results of earlier runs, see cache.c */
+static int refresh = 0;           /* run again what is in the cache */
+static int fecgroupsize = 0;      /* A's packets per parity packet, see fec.c */
+static float fecwait = 5.0;       /* time units a group stays open at most */
+static int aggmax = 0;            /* messages held, packets per frame, see aggregate.c */
+static float aggdelay = 1.0;      /* time units a message is held at most */
+static float timeunit = 1000.0;   /* wall-clock microseconds per time unit */
+#define MAX_PLUGINS 16
+static const struct proto_ops *plugins[MAX_PLUGINS];
+static int nplugins = 0;
 
 /**
  * Checks if the array pointed to by input holds a valid number.
@@ -102,35 +196,185 @@ float read_arg_float(char c)
 	return val;
 }
 
+float read_arg_prob(const char *name)
+{
+	float val = atof(optarg);
+	if(val < 0.0 || val > 1.0){
+		fprintf(stderr, "Invalid value for --%s\n", name);
+		exit(-1);
+	}
+	return val;
+}
+
+float read_arg_time(const char *name)
+{
+	float val = atof(optarg);
+	if(val < 0.0){
+		fprintf(stderr, "Invalid value for --%s\n", name);
+		exit(-1);
+	}
+	return val;
+}
+
 void display_usage(char *filename)
 {
 	printf("Usage:\n %s -s Seed -w Window size -m Number of messages to simulate -l Loss -c Corruption -t Average time between messages from sender's layer5 -v Tracing\n", filename);
+	printf("Options:\n");
+	printf(" --reorder=P       Probability that a packet skips the in-order channel\n");
+	printf(" --reorder-max=T   Max extra delay of a reordered packet (default 10)\n");
+	printf(" --link-rate=R     Bottleneck link rate in packets per time unit\n");
+	printf(" --queue-limit=N   Bottleneck link buffer in packets (default 64)\n");
+	printf(" --red=MIN,MAX,P   Use RED instead of tail drop on the link\n");
+	printf(" --metrics=FILE    Write run metrics as JSON to FILE (- for stdout)\n");
+	printf(" --sample=FILE     Write a CSV time series of the simulator state to FILE\n");
+	printf(" --sample-interval=T  Simulated time between samples (default 100)\n");
+	printf(" --snapshot=FILE   Save the whole simulation to FILE and stop, see --snapshot-at\n");
+	printf(" --snapshot-at=T   Simulated time at which to save the snapshot (default 0)\n");
+	printf(" --restore=FILE    Continue a saved simulation, with the parameters given here\n");
+	printf(" --record=FILE     Record every loss, delay, corruption and arrival gap to FILE\n");
+	printf(" --replay=FILE     Take them from a recording, by entity and packet number\n");
+	printf(" --flows=N         Run N sender/receiver pairs over the shared link (default 1)\n");
+	printf(" --threads=N       Split the flows over N threads, with the same results\n");
+	printf(" --traffic=MODEL   Message arrivals: uniform (default), poisson, saturated,\n");
+	printf("                   onoff[:ON,OFF] or trace:FILE of gaps\n");
+	printf(" --payload=DATA    Message contents: letters (default), random or a text\n");
+	printf(" --udp             Run A, B and the medium as threads exchanging UDP datagrams\n");
+	printf("                   on 127.0.0.1, in wall-clock time\n");
+	printf(" --ring            Run A and B as threads passing packets through shared-memory\n");
+	printf("                   rings, with losses and corruption but no link or delay\n");
+	printf(" --realtime        Run the events no faster than the wall clock allows\n");
+	printf(" --input=FILE      With --realtime, messages are the lines read from a pipe,\n");
+	printf("                   FIFO or - for standard input (12 bytes of each are kept)\n");
+	printf(" --time-unit=US    Wall-clock microseconds per time unit with --udp, --ring or\n");
+	printf("                   --realtime\n");
+	printf("                   (default 1000)\n");
+	printf(" --seq-bits=K      Sequence numbers of GBN and SR count modulo 2^K, 1 to 31\n");
+	printf("                   (default 31)\n");
+	printf(" --perf            Count cycles, instructions, cache and branch misses by phase\n");
+	printf("                   of the run, where the hardware counters are available\n");
+	printf(" --replications=N  Run up to N replications with seeds -s, -s+1, ... in parallel\n");
+	printf("                   processes, and report 95%% confidence intervals\n");
+	printf(" --jobs=J          Replications running at a time (default one per CPU)\n");
+	printf(" --batch-means=T   Confidence intervals from batches of T time units of one run\n");
+	printf(" --precision=P     Stop once the intervals are within P of the means, 0 never\n");
+	printf("                   (default 0.05)\n");
+	printf(" --cache=DIR       Print the result of an identical earlier run from DIR, or\n");
+	printf("                   run and save it there\n");
+	printf(" --refresh         With --cache, run anyway and replace the saved result\n");
+	printf(" --fec=K[,T]       Send the XOR of every K packets from A after them, for B\n");
+	printf("                   to rebuild a lost one, 2 to 32, or of fewer once the\n");
+	printf("                   first has waited T time units, 0 never (default 5)\n");
+	printf(" --aggregate=M[,T] Hold messages at A until M are waiting or the first has\n");
+	printf("                   waited T time units (default 1), and send what each side\n");
+	printf("                   sends at once in frames of up to M packets, 2 to 32\n");
+	printf(" -p, --protocol=SO Run the protocol plugin SO (e.g. gbn.so); repeat to run\n");
+	printf("                   several protocols one after the other on the same input\n");
 }
 
-int main(int argc, char **argv)
+void read_arg_red()
 {
-   struct event *eventptr;
-   struct msg  msg2give;
-   struct pkt  pkt2give;
-   
-   int i,j;
-   char c;
+	if(sscanf(optarg, "%f,%f,%f", &red_minth, &red_maxth, &red_maxp) != 3 ||
+	   red_minth < 0.0 || red_maxth <= red_minth || red_maxp < 0.0 || red_maxp > 1.0){
+		fprintf(stderr, "Invalid value for --red\n");
+		exit(-1);
+	}
+	red = 1;
+}
 
-   int opt;
-   int seed;
+/* long-only options are numbered above the char range */
+enum {
+	OPT_REORDER = 256,
+	OPT_REORDER_MAX,
+	OPT_LINK_RATE,
+	OPT_QUEUE_LIMIT,
+	OPT_RED,
+	OPT_METRICS,
+	OPT_SAMPLE,
+	OPT_SAMPLE_INTERVAL,
+	OPT_SNAPSHOT,
+	OPT_SNAPSHOT_AT,
+	OPT_RESTORE,
+	OPT_RECORD,
+	OPT_REPLAY,
+	OPT_FLOWS,
+	OPT_THREADS,
+	OPT_TRAFFIC,
+	OPT_PAYLOAD,
+	OPT_UDP,
+	OPT_RING,
+	OPT_REALTIME,
+	OPT_INPUT,
+	OPT_TIME_UNIT,
+	OPT_SEQ_BITS,
+	OPT_PERF,
+	OPT_REPLICATIONS,
+	OPT_JOBS,
+	OPT_BATCH_MEANS,
+	OPT_PRECISION,
+	OPT_CACHE,
+	OPT_REFRESH,
+	OPT_FEC,
+	OPT_AGGREGATE
+};
 
-   //Check for number of arguments
-   if(argc != 15){
-   		fprintf(stderr, "Missing arguments!\n");
-		display_usage(argv[0]);
-		return -1;
-   }
+static struct option long_options[] = {
+	{"reorder",     required_argument, 0, OPT_REORDER},
+	{"reorder-max", required_argument, 0, OPT_REORDER_MAX},
+	{"link-rate",   required_argument, 0, OPT_LINK_RATE},
+	{"queue-limit", required_argument, 0, OPT_QUEUE_LIMIT},
+	{"red",         required_argument, 0, OPT_RED},
+	{"metrics",     required_argument, 0, OPT_METRICS},
+	{"sample",      required_argument, 0, OPT_SAMPLE},
+	{"sample-interval", required_argument, 0, OPT_SAMPLE_INTERVAL},
+	{"snapshot",    required_argument, 0, OPT_SNAPSHOT},
+	{"snapshot-at", required_argument, 0, OPT_SNAPSHOT_AT},
+	{"restore",     required_argument, 0, OPT_RESTORE},
+	{"record",      required_argument, 0, OPT_RECORD},
+	{"replay",      required_argument, 0, OPT_REPLAY},
+	{"protocol",    required_argument, 0, 'p'},
+	{"flows",       required_argument, 0, OPT_FLOWS},
+	{"threads",     required_argument, 0, OPT_THREADS},
+	{"traffic",     required_argument, 0, OPT_TRAFFIC},
+	{"payload",     required_argument, 0, OPT_PAYLOAD},
+	{"udp",         no_argument,       0, OPT_UDP},
+	{"ring",        no_argument,       0, OPT_RING},
+	{"realtime",    no_argument,       0, OPT_REALTIME},
+	{"input",       required_argument, 0, OPT_INPUT},
+	{"time-unit",   required_argument, 0, OPT_TIME_UNIT},
+	{"seq-bits",    required_argument, 0, OPT_SEQ_BITS},
+	{"perf",        no_argument,       0, OPT_PERF},
+	{"replications", required_argument, 0, OPT_REPLICATIONS},
+	{"jobs",        required_argument, 0, OPT_JOBS},
+	{"batch-means", required_argument, 0, OPT_BATCH_MEANS},
+	{"precision",   required_argument, 0, OPT_PRECISION},
+	{"cache",       required_argument, 0, OPT_CACHE},
+	{"refresh",     no_argument,       0, OPT_REFRESH},
+	{"fec",         required_argument, 0, OPT_FEC},
+	{"aggregate",   required_argument, 0, OPT_AGGREGATE},
+	{0, 0, 0, 0}
+};
+
+#ifndef SIMULATOR_NO_MAIN
+int simulate();
+int replication(int index, struct replicate_result *result);
+static int writemetrics(const char *line, int cached);
+static char *cacheoptions();
+
+int main(int argc, char **argv)
+{
+   char *line;
+   int rc;
+   int opt;
+   int nrequired = 0;          /* mandatory short options seen so far */
+   int k;
 
    /* 
     * Parse the arguments 
     * http://www.gnu.org/software/libc/manual/html_node/Example-of-Getopt.html 
     */
-    while((opt = getopt(argc, argv,"s:w:m:l:c:t:v:")) != -1){
+    while((opt = getopt_long(argc, argv,"s:w:m:l:c:t:v:p:", long_options, NULL)) != -1){
+    	if (opt < 256 && strchr("swmlctv", opt) != NULL)
+    		nrequired++;
     	switch (opt){
     		case 's':   seed = read_arg_int(opt);
                     	break;
@@ -149,105 +393,716 @@ int main(int argc, char **argv)
             			break;
             case 'v': 	TRACE = read_arg_int(opt);
             			break;
+            case OPT_REORDER:
+            			reorderprob = read_arg_prob("reorder");
+            			break;
+            case OPT_REORDER_MAX:
+            			reordermax = read_arg_time("reorder-max");
+            			break;
+            case OPT_LINK_RATE:
+            			linkrate = read_arg_time("link-rate");
+            			break;
+            case OPT_QUEUE_LIMIT:
+            			if((queuelimit = read_arg_int('q')) < 1){
+            				fprintf(stderr, "Invalid value for --queue-limit\n");
+            				exit(-1);
+            			}
+            			break;
+            case OPT_RED:
+            			read_arg_red();
+            			break;
+            case OPT_METRICS:
+            			metricsfile = optarg;
+            			break;
+            case OPT_SAMPLE:
+            			samplefile = optarg;
+            			break;
+            case OPT_SAMPLE_INTERVAL:
+            			if((sampleinterval = read_arg_time("sample-interval")) <= 0.0){
+            				fprintf(stderr, "Invalid value for --sample-interval\n");
+            				exit(-1);
+            			}
+            			break;
+            case OPT_SNAPSHOT:
+            			snapshotfile = optarg;
+            			break;
+            case OPT_SNAPSHOT_AT:
+            			snapshotat = SIM_TICKS(read_arg_time("snapshot-at"));
+            			break;
+            case OPT_RESTORE:
+            			restorefile = optarg;
+            			break;
+            case OPT_RECORD:
+            			if (record_open(optarg) < 0)
+            				exit(-1);
+            			break;
+            case OPT_REPLAY:
+            			if (replay_open(optarg) < 0)
+            				exit(-1);
+            			break;
+            case OPT_FLOWS:
+            			if((nflows = read_arg_int('f')) < 1){
+            				fprintf(stderr, "Invalid value for --flows\n");
+            				exit(-1);
+            			}
+            			break;
+            case OPT_THREADS:
+            			nthreads = read_arg_int('j');
+            			break;
+            case OPT_TRAFFIC:
+            			if (traffic_open(optarg) < 0)
+            				exit(-1);
+            			traffic = 1;
+            			break;
+            case OPT_PAYLOAD:
+            			if (payload_open(optarg) < 0)
+            				exit(-1);
+            			break;
+            case OPT_UDP:
+            			udp = 1;
+            			break;
+            case OPT_RING:
+            			ring = 1;
+            			break;
+            case OPT_REALTIME:
+            			realtime = 1;
+            			break;
+            case OPT_INPUT:
+            			if (realtime_input(optarg) < 0)
+            				exit(-1);
+            			input = 1;
+            			break;
+            case OPT_TIME_UNIT:
+            			if((timeunit = read_arg_time("time-unit")) <= 0.0){
+            				fprintf(stderr, "Invalid value for --time-unit\n");
+            				exit(-1);
+            			}
+            			break;
+            case OPT_SEQ_BITS:
+            			if((seqbits = read_arg_int('k')) < 1 || seqbits > 31){
+            				fprintf(stderr, "Invalid value for --seq-bits\n");
+            				exit(-1);
+            			}
+            			break;
+            case OPT_PERF:
+            			perf = 1;
+            			break;
+            case OPT_REPLICATIONS:
+            			if((nreplications = read_arg_int('r')) < 2){
+            				fprintf(stderr, "Invalid value for --replications\n");
+            				exit(-1);
+            			}
+            			break;
+            case OPT_JOBS:
+            			if((njobs = read_arg_int('j')) < 1){
+            				fprintf(stderr, "Invalid value for --jobs\n");
+            				exit(-1);
+            			}
+            			break;
+            case OPT_BATCH_MEANS:
+            			if((batchlength = read_arg_time("batch-means")) <= 0.0){
+            				fprintf(stderr, "Invalid value for --batch-means\n");
+            				exit(-1);
+            			}
+            			break;
+            case OPT_PRECISION:
+            			precision = read_arg_prob("precision");
+            			break;
+            case OPT_CACHE:
+            			cachedir = optarg;
+            			break;
+            case OPT_REFRESH:
+            			refresh = 1;
+            			break;
+            case OPT_FEC:
+            			if(sscanf(optarg, "%d,%f", &fecgroupsize, &fecwait) < 1 ||
+            			   fecgroupsize < 2 || fecgroupsize > 32 || fecwait < 0.0){
+            				fprintf(stderr, "Invalid value for --fec\n");
+            				exit(-1);
+            			}
+            			break;
+            case OPT_AGGREGATE:
+            			if(sscanf(optarg, "%d,%f", &aggmax, &aggdelay) < 1 ||
+            			   aggmax < 2 || aggmax > 32 || aggdelay < 0.0){
+            				fprintf(stderr, "Invalid value for --aggregate\n");
+            				exit(-1);
+            			}
+            			break;
+            case 'p':	if (nplugins == MAX_PLUGINS) {
+            				fprintf(stderr, "Too many protocols, at most %d\n", MAX_PLUGINS);
+            				exit(-1);
+            			}
+            			if ((plugins[nplugins++] = plugin_load(optarg)) == NULL)
+            				exit(-1);
+            			break;
             case '?':   
            	default:    fprintf(stderr, "Invalid arguments!\n");
 						display_usage(argv[0]);
 						return -1;
        }
    }
+
+   //Check for number of arguments
+   if(nrequired != 7 || optind != argc){
+   		fprintf(stderr, "Missing arguments!\n");
+		display_usage(argv[0]);
+		return -1;
+   }
   
+   /* message ids, tagged into the payloads, are numbered across flows */
+   if ((long long)nflows * nsimmax > 0x7fffffff) {
+      fprintf(stderr, "--flows times -m is too large\n");
+      return -1;
+   }
+
+   /* a parallel run defers the medium's decisions, so it needs the random
+      streams of each flow, and records nothing while it runs */
+   if (nthreads > 0 && (nflows < 2 || samplefile != NULL || snapshotfile != NULL ||
+                        record_active() || replay_active())) {
+      fprintf(stderr, "--threads needs --flows of 2 or more, and no --sample, --snapshot, --record or --replay\n");
+      return -1;
+   }
+
+   /* the UDP backend runs in wall-clock time, with nothing to save or sample */
+   if (udp && (nthreads > 0 || samplefile != NULL || snapshotfile != NULL || restorefile != NULL)) {
+      fprintf(stderr, "--udp takes no --threads, --sample, --snapshot or --restore\n");
+      return -1;
+   }
+   /* and the rings have no link and no delay to reorder by */
+   if (ring && (udp || nthreads > 0 || samplefile != NULL || snapshotfile != NULL ||
+                restorefile != NULL || linkrate > 0.0 || reorderprob > 0.0)) {
+      fprintf(stderr, "--ring takes no --udp, --threads, --sample, --snapshot, --restore, --link-rate or --reorder\n");
+      return -1;
+   }
+
+   /* the real-time mode paces the main loop, which the others replace */
+   if (realtime && (udp || ring || nthreads > 0 || snapshotfile != NULL || restorefile != NULL)) {
+      fprintf(stderr, "--realtime takes no --udp, --ring, --threads, --snapshot or --restore\n");
+      return -1;
+   }
+   /* the counters follow the thread that opens them */
+   if (perf && (udp || ring || nthreads > 0)) {
+      fprintf(stderr, "--perf takes no --udp, --ring or --threads\n");
+      return -1;
+   }
+   /* replications throw away the output of the runs, and batch means
+      follow the main loop */
+   if (nreplications > 0 && (batchlength > 0.0 || udp || ring || realtime || samplefile != NULL ||
+                             snapshotfile != NULL || restorefile != NULL || metricsfile != NULL ||
+                             record_active() || replay_active())) {
+      fprintf(stderr, "--replications takes no --batch-means, --udp, --ring, --realtime, --sample, --snapshot, --restore, --metrics, --record or --replay\n");
+      return -1;
+   }
+   if (batchlength > 0.0 && (udp || ring || realtime || nthreads > 0)) {
+      fprintf(stderr, "--batch-means takes no --udp, --ring, --realtime or --threads\n");
+      return -1;
+   }
+   /* only what is the same every time can be cached, and nothing that
+      writes files of its own */
+   if (cachedir != NULL && (udp || ring || realtime || perf || samplefile != NULL ||
+                            snapshotfile != NULL || restorefile != NULL ||
+                            record_active() || replay_active())) {
+      fprintf(stderr, "--cache takes no --udp, --ring, --realtime, --perf, --sample, --snapshot, --restore, --record or --replay\n");
+      return -1;
+   }
+   /* the decoder lives in the main loop, and its state is not saved */
+   if (fecgroupsize > 0 && (udp || ring || nthreads > 0 || snapshotfile != NULL || restorefile != NULL)) {
+      fprintf(stderr, "--fec takes no --udp, --ring, --threads, --snapshot or --restore\n");
+      return -1;
+   }
+   /* the held messages and the frames live in the main loop as well */
+   if (aggmax > 0 && (udp || ring || nthreads > 0 || snapshotfile != NULL || restorefile != NULL)) {
+      fprintf(stderr, "--aggregate takes no --udp, --ring, --threads, --snapshot or --restore\n");
+      return -1;
+   }
+   if (refresh && cachedir == NULL) {
+      fprintf(stderr, "--refresh needs --cache\n");
+      return -1;
+   }
+   if (cachedir != NULL) {
+      line = cacheoptions();
+      rc = cache_open(cachedir, refresh, line);
+      free(line);
+      if (rc < 0)
+         return -1;
+      }
+   if (input && (!realtime || traffic || nplugins > 1)) {
+      fprintf(stderr, "--input needs --realtime, a single protocol and no --traffic\n");
+      return -1;
+   }
+
+   if (nplugins == 0) {
+      if (&proto_ops == NULL) {
+         fprintf(stderr, "No protocol given, use -p\n");
+         display_usage(argv[0]);
+         return -1;
+      }
+      plugins[nplugins++] = &proto_ops;
+   }
+   if (nplugins > 1 && (samplefile != NULL || snapshotfile != NULL ||
+                        restorefile != NULL || record_active())) {
+      fprintf(stderr, "--sample, --snapshot, --restore and --record take a single protocol\n");
+      return -1;
+   }
+
+   for (k = 0; k < nplugins; k++) {
+      proto = plugins[k];
+      if (nplugins > 1)
+         printf("%s Protocol: %s\n", k > 0 ? "\n" : "", proto->name);
+      if (cachedir != NULL) {
+         if (cache_fetch(proto, &line)) {
+            if (line != NULL && writemetrics(line, 1) < 0)
+               return -1;
+            free(line);
+            continue;
+            }
+         }
+      if (nreplications > 0) {
+         cache_begin();   /* all they print is the report */
+         rc = replicate_run(replication, nreplications,
+                            njobs > 0 ? njobs : (int)sysconf(_SC_NPROCESSORS_ONLN), precision);
+         }
+      else
+         rc = simulate();
+      if (cachedir != NULL)
+         cache_end(rc == 0);
+      if (rc < 0)
+         return -1;
+   }
+   return 0;
+}
+
+/**
+ * Appends a run's line to the --metrics file, the first one of this
+ * process replacing what the file had.
+ *
+ * @param line JSON object and newline
+ * @param cached 1 if the line comes from the cache, whose report has it
+ *               already when it goes to stdout
+ * @return 0, or -1 on error
+ */
+static int writemetrics(const char *line, int cached)
+{
+   FILE *fp;
+
+   if (metricsfile == NULL)
+      return 0;
+   if (!strcmp(metricsfile, "-")) {
+      if (!cached)
+         fputs(line, stdout);
+      return 0;
+      }
+   if ((fp = fopen(metricsfile, nmetrics++ ? "a" : "w")) == NULL) {
+      perror(metricsfile);
+      return -1;
+      }
+   fputs(line, fp);
+   fclose(fp);
+   return 0;
+}
+
+/**
+ * Writes the options of the run that shape its report, one per line in a
+ * fixed order and as parsed, for the key of its --cache record.  Their
+ * order on the command line, and where the files of --cache and
+ * --metrics are, make no difference.
+ *
+ * @return the text, to be freed
+ */
+static char *cacheoptions()
+{
+   FILE *fp;
+   char *text;
+   size_t len;
+
+   fp = open_memstream(&text, &len);
+   fprintf(fp, "seed %d\nwinsize %d\nnsimmax %d\n", seed, win_size, nsimmax);
+   fprintf(fp, "lossprob %.9g\ncorruptprob %.9g\nlambda %.9g\n", lossprob, corruptprob, lambda);
+   fprintf(fp, "flows %d\n", nflows);
+   fprintf(fp, "link %.9g %d", linkrate, queuelimit);
+   if (red)
+      fprintf(fp, " red %.9g,%.9g,%.9g", red_minth, red_maxth, red_maxp);
+   fprintf(fp, "\nreorder %.9g %.9g\n", reorderprob, reordermax);
+   traffic_describe(fp);
+   fprintf(fp, "seq-bits %d\n", seqbits);
+   fprintf(fp, "fec %d,%.9g\naggregate %d,%.9g\n", fecgroupsize, fecwait, aggmax, aggdelay);
+   fprintf(fp, "trace %d\nthreads %d\n", TRACE, nthreads);
+   if (nreplications > 0)
+      fprintf(fp, "replications %d %d %.9g\n", nreplications,
+              njobs > 0 ? njobs : (int)sysconf(_SC_NPROCESSORS_ONLN), precision);
+   if (batchlength > 0.0)
+      fprintf(fp, "batch-means %.9g %.9g\n", batchlength, precision);
+   /* a --metrics line on stdout is part of the report */
+   if (metricsfile != NULL && !strcmp(metricsfile, "-"))
+      fprintf(fp, "metrics -\n");
+   fclose(fp);
+   return text;
+}
+
+/**
+ * Runs replication index of the simulation, in a process of its own,
+ * with the seed index after -s.
+ *
+ * @return 0, or -1 on error
+ */
+int replication(int index, struct replicate_result *result)
+{
+   int delivered;
+   double latency;
+
+   seed += index;
+   if (simulate() < 0)
+      return -1;
+   metrics_totals(&delivered, &latency);
+   result->throughput = B_application/SIM_UNITS(simtime);
+   result->latency = delivered > 0 ? latency / delivered : -1.0;
+   return 0;
+}
+
+/**
+ * Runs the configured simulation once with the current protocol, and
+ * reports on it.
+ *
+ * @return 0, or -1 on error
+ */
+int simulate()
+{
+   struct event *eventptr;
+   int nflowsdone = 0;
+   FILE *fp;
+   char *line;
+   size_t len;
+
    init(seed);
-   A_init();
-   B_init();
+   for (curflow=0; curflow<nflows; curflow++) {
+      proto->A_init();
+      proto->B_init();
+      if (traffic_due())
+         schedulearrival(0.0, 1);
+      }
+   curflow = 0;
+
+   if (fecgroupsize > 0)
+      fec_init(fecgroupsize, fecwait, nflows);
+   if (aggmax > 0)
+      agg_init(aggmax, aggdelay, nflows);
+
+   if (restorefile != NULL && snapshot_load(restorefile, proto->name) < 0)
+      return -1;
+
+   if (samplefile != NULL && sampler_open(samplefile, sampleinterval) < 0)
+      return -1;
+
+   if (perf)
+      perf_open();   /* the run goes on without counters if there are none */
+
+   if (batchlength > 0.0)
+      batch_open(batchlength, precision);
    
-   while (1) {
-        eventptr = evlist;            /* get next event to simulate */
-        if (eventptr==NULL)
-           goto terminate;
-        evlist = evlist->next;        /* remove this event from event list */
-        if (evlist!=NULL)
-           evlist->prev=NULL;
-        if (TRACE>=2) {
-           printf("\nEVENT time: %f,",eventptr->evtime);
-           printf("  type: %d",eventptr->evtype);
-           if (eventptr->evtype==0)
-	       printf(", timerinterrupt  ");
-             else if (eventptr->evtype==1)
-               printf(", fromlayer5 ");
-             else
-	     printf(", fromlayer3 ");
-           printf(" entity: %d\n",eventptr->eventity);
+   if (udp) {
+      if (udp_run(timeunit) < 0)
+         return -1;
+      }
+   else if (ring) {
+      if (ring_run(timeunit) < 0)
+         return -1;
+      }
+   else if (realtime) {
+      if (realtime_run(timeunit) < 0)
+         return -1;
+      }
+   else if (nthreads > 0) {
+      if (parallel_run(nthreads) < 0)
+         return -1;
+      }
+   else
+   while ((eventptr = nextevent()) != NULL) {
+        if (snapshotfile != NULL && eventptr->evtime >= snapshotat) {
+           if (snapshot_save(snapshotfile, proto->name) < 0)
+              return -1;
+           printf(" Snapshot saved at time %f after sending %d msgs from layer5\n",SIM_UNITS(simtime),nsim);
+           return 0;
            }
-        time = eventptr->evtime;        /* update time to next event time */
-        if (nsim==nsimmax)
-	  break;                        /* all done with simulation */
-        if (eventptr->evtype == FROM_LAYER5 ) {
-            generate_next_arrival();   /* set up future arrival */
-            /* fill in msg to give with string of same letter */    
-            j = nsim % 26; 
-            for (i=0; i<20; i++)  
-               msg2give.data[i] = 97 + j;
-            if (TRACE>2) {
-               printf("          MAINLOOP: data given to student: ");
-                 for (i=0; i<20; i++) 
-                  printf("%c", msg2give.data[i]);
-               printf("\n");
-	     }
-            nsim++;
-            if (eventptr->eventity == A)
-            {
-            	A_application += 1;
-            	A_output(msg2give);
-            }
-            /*   
-             else
-               B_output(msg2give);
-             */  
-            }
-          else if (eventptr->evtype ==  FROM_LAYER3) {
-            pkt2give.seqnum = eventptr->pktptr->seqnum;
-            pkt2give.acknum = eventptr->pktptr->acknum;
-            pkt2give.checksum = eventptr->pktptr->checksum;
-            for (i=0; i<20; i++)  
-                pkt2give.payload[i] = eventptr->pktptr->payload[i];
-	    if (eventptr->eventity ==A)      /* deliver packet by calling */
-            	A_input(pkt2give);            /* appropriate entity */
-            else
-            {
-            	B_transport += 1;
-            	B_input(pkt2give);
-            }
-	    free(eventptr->pktptr);          /* free the memory for packet */
-            }
-          else if (eventptr->evtype ==  TIMER_INTERRUPT) {
-            if (eventptr->eventity == A) 
-	       A_timerinterrupt();
-           /*
-             else
-	       B_timerinterrupt();
-	       */
-             }
-          else  {
-	     printf("INTERNAL PANIC: unknown event type \n");
-             }
-        free(eventptr);
+        sampler_advance(eventptr->evtime);
+        /* batch means may have what they need before the last flow stops */
+        if (batchlength > 0.0 && batch_advance(eventptr->evtime))
+           break;
+        eventptr = removeevent();     /* get next event to simulate */
+        /* all done with simulation when the last flow stops */
+        if (handleevent(eventptr) && ++nflowsdone == nflows)
+           break;
         }
 
-terminate:
+	sampler_close(simtime);
+
+	/* the cache keeps what is printed from here on */
+	cache_begin();
+
 	//Do NOT change any of the following printfs
-	printf(" Simulator terminated at time %f\n after sending %d msgs from layer5\n",time,nsim);
+	printf(" Simulator terminated at time %f\n after sending %d msgs from layer5\n",SIM_UNITS(simtime),nsim);
 	
 	printf("\n");
 	printf("[PA2]%d packets sent from the Application Layer of Sender A[/PA2]\n", A_application);
 	printf("[PA2]%d packets sent from the Transport Layer of Sender A[/PA2]\n", A_transport);
 	printf("[PA2]%d packets received at the Transport layer of Receiver B[/PA2]\n", B_transport);
 	printf("[PA2]%d packets received at the Application layer of Receiver B[/PA2]\n", B_application);
-	printf("[PA2]Total time: %f time units[/PA2]\n", time);
-	printf("[PA2]Throughput: %f packets/time units[/PA2]\n", B_application/time);
+	printf("[PA2]Total time: %f time units[/PA2]\n", SIM_UNITS(simtime));
+	printf("[PA2]Throughput: %f packets/time units[/PA2]\n", B_application/SIM_UNITS(simtime));
+	if (reorderprob > 0.0)
+		printf(" %d packets reordered in media\n", nreordered);
+	if (linkrate > 0.0)
+		printlinkstats();
+	if (udp)
+		udp_printstats(B_application);
+	if (ring)
+		ring_printstats(B_application);
+	if (realtime)
+		realtime_printstats(B_application);
+	if (fec_k > 0)
+		fec_printstats(B_application, SIM_UNITS(simtime));
+	if (agg_max > 0)
+		agg_printstats();
+	printskipped();
+	if (nflows > 1)
+		metrics_print_flows(simtime);
+	if (batchlength > 0.0)
+		batch_report();
+	PROFILE_REPORT();
+	perf_report(nprocessed);
+	record_close();
+
+	/* one JSON line per protocol when several are run */
+	if (metricsfile != NULL || cachedir != NULL) {
+		fp = open_memstream(&line, &len);
+		metrics_write(fp, proto->name, simtime);
+		fclose(fp);
+		if (writemetrics(line, 0) < 0)
+			return -1;
+		if (cachedir != NULL)
+			cache_metrics(line);
+		free(line);
+	}
 	return 0;
 }
+#endif /* SIMULATOR_NO_MAIN */
+
+
+
+/* discardevent(): free an event that will not be handled */
+static void discardevent(eventptr)
+struct event *eventptr;
+{
+   if (eventptr->evtype == TIMER_INTERRUPT)
+      *timerslot(eventptr->flow, eventptr->eventity, eventptr->timerid) = NULL;
+   freeevent(eventptr);
+}
+
+/* handleevent(): simulate one event taken off the queue, and free it.    */
+/* Returns 1 if it stopped its flow, which had sent its nsimmax messages; */
+/* the events of a stopped flow are dropped.                              */
+int handleevent(eventptr)
+struct event *eventptr;
+{
+   struct msg  msg2give;
+   struct pkt  pkt2give;
+   struct flow *fl = &flows[eventptr->flow];
+   int i,id;
+
+   if (fl->done) {
+      discardevent(eventptr);
+      return 0;
+      }
+   if (TRACE>=2) {
+      printf("\nEVENT time: %f,",SIM_UNITS(eventptr->evtime));
+      printf("  type: %d",eventptr->evtype);
+      if (eventptr->evtype==0)
+	  printf(", timerinterrupt  ");
+        else if (eventptr->evtype==1)
+          printf(", fromlayer5 ");
+        else if (eventptr->evtype==FEC_TIMEOUT)
+          printf(", fectimeout ");
+        else if (eventptr->evtype==AGG_TIMEOUT)
+          printf(", aggtimeout ");
+        else
+	printf(", fromlayer3 ");
+      printf(" entity: %d",eventptr->eventity);
+      if (nflows > 1)
+	  printf(" flow: %d",eventptr->flow);
+      printf("\n");
+      }
+   simtime = eventptr->evtime;     /* update time to next event time */
+   curflow = eventptr->flow;
+   if (agg_max > 0) {   /* no --threads with it, so the frames are shared */
+      if (!eventptr->inframe || curflow != frameflow)   /* what is sent now */
+         framelen[A] = framelen[B] = 0;                  /* starts a frame   */
+      frameflow = curflow;
+      }
+   if (fl->nsim==nsimmax) {
+      fl->done = 1;
+      fl->stoptime = simtime;
+      if (!parallel_defer_event(STOP_EVENT, eventptr->eventity, -1))
+         accountevent(STOP_EVENT, eventptr->eventity, -1);
+      discardevent(eventptr);
+      return 1;
+      }
+   if (eventptr->evtype == FROM_LAYER5 ) {
+       /* fill in msg to give, by default with string of same letter, */
+       /* and tag the tail of the message with its number.  Messages  */
+       /* read by the real-time mode bring their data, and the next   */
+       /* one comes when it is read (see realtime.c)                  */
+       id = curflow*nsimmax + fl->nsim;
+       if (eventptr->pktptr != NULL)
+          memcpy(msg2give.data, eventptr->pktptr->payload, sizeof(msg2give.data));
+       else {
+          if (!eventptr->extra)
+             generate_next_arrival();   /* set up future arrival */
+          traffic_fill(&msg2give, fl->nsim, id);
+          }
+       metrics_tag(&msg2give, id);
+       if (TRACE>2) {
+          printf("          MAINLOOP: data given to student: ");
+            for (i=0; i<20; i++) 
+             printf("%c", msg2give.data[i]);
+          printf("\n");
+	}
+       fl->nsim++;
+       if (!parallel_defer_event(FROM_LAYER5, eventptr->eventity, id))
+          accountevent(FROM_LAYER5, eventptr->eventity, id);
+       if (eventptr->eventity == A && agg_max > 0) {
+          /* held until there are enough to send at once */
+          i = agg_hold(curflow, &msg2give, simtime);
+          if (i == agg_max || agg_delay == 0.0)
+             aggflush();
+          else if (i == 1)
+             scheduletimeout(AGG_TIMEOUT, agg_delay, -1);
+          }
+       else if (eventptr->eventity == A) {
+       	PERF_ENTER(ph, PERF_CALLBACKS);
+       	PROFILE_BEGIN(t0);
+       	proto->A_output(msg2give);
+       	PROFILE_END(PROF_A_OUTPUT, t0);
+       	PERF_LEAVE(ph);
+       	}
+       /*   
+        else
+          B_output(msg2give);
+        */  
+       }
+     else if (eventptr->evtype ==  FROM_LAYER3) {
+       pkt2give.seqnum = eventptr->pktptr->seqnum;
+       pkt2give.acknum = eventptr->pktptr->acknum;
+       pkt2give.checksum = eventptr->pktptr->checksum;
+       for (i=0; i<20; i++)  
+           pkt2give.payload[i] = eventptr->pktptr->payload[i];
+       if (!parallel_defer_event(FROM_LAYER3, eventptr->eventity, -1))
+          accountevent(eventptr->fecgroup >= 0 && eventptr->fecindex < 0 ?
+                       FEC_PARITY : FROM_LAYER3, eventptr->eventity, -1);
+       if (eventptr->eventity ==A) {    /* deliver packet by calling */
+       	PERF_ENTER(ph, PERF_CALLBACKS);
+       	PROFILE_BEGIN(t0);
+       	proto->A_input(pkt2give);     /* appropriate entity */
+       	PROFILE_END(PROF_A_INPUT, t0);
+       	PERF_LEAVE(ph);
+       	}
+       else {
+       	PERF_ENTER(ph, PERF_CALLBACKS);
+       	PROFILE_BEGIN(t0);
+       	if (eventptr->fecgroup >= 0) {
+       	   /* B_transport counted the rebuilt copy of a late one already */
+       	   if (fec_receive(curflow, eventptr->fecgroup, eventptr->fecindex, &pkt2give, fecdeliver))
+       	      B_transport -= 1;
+       	   }
+       	else
+       	   proto->B_input(pkt2give);
+       	PROFILE_END(PROF_B_INPUT, t0);
+       	PERF_LEAVE(ph);
+       	}
+       }
+     else if (eventptr->evtype ==  TIMER_INTERRUPT) {
+       *timerslot(curflow, eventptr->eventity, eventptr->timerid) = NULL;
+       if (!parallel_defer_event(TIMER_INTERRUPT, eventptr->eventity, -1))
+          accountevent(TIMER_INTERRUPT, eventptr->eventity, -1);
+       if (eventptr->eventity == A) {
+          PERF_ENTER(ph, PERF_CALLBACKS);
+          PROFILE_BEGIN(t0);
+          if (eventptr->timerid >= 0)
+             proto->A_timerinterrupt_id(eventptr->timerid);
+          else
+             proto->A_timerinterrupt();
+          PROFILE_END(PROF_A_TIMER, t0);
+          PERF_LEAVE(ph);
+          }
+      /*
+        else
+          B_timerinterrupt();
+          */
+        }
+     else if (eventptr->evtype ==  FEC_TIMEOUT) {
+       accountevent(FEC_TIMEOUT, eventptr->eventity, -1);
+       if ((i = fec_close(curflow, eventptr->fecgroup, &pkt2give)) > 0)
+          transmit(A, &pkt2give, flows[curflow].nextseq++, eventptr->fecgroup, -i);
+       }
+     else if (eventptr->evtype ==  AGG_TIMEOUT) {
+       accountevent(AGG_TIMEOUT, eventptr->eventity, -1);
+       if (agg_due(curflow, simtime))
+          aggflush();
+       }
+     else  {
+        printf("INTERNAL PANIC: unknown event type \n");
+        }
+   /* a saturated source gives A a message as soon as it has room; only */
+   /* the events of A change that                                       */
+   if (eventptr->eventity == A && traffic_due())
+      schedulearrival(0.0, 1);
+   freeevent(eventptr);
+   return 0;
+}
+
+/* aggflush(): give A the messages held for the current flow, in a row */
+static void aggflush()
+{
+   struct msg message;
+   PERF_ENTER(ph, PERF_CALLBACKS);
+
+   while (agg_take(curflow, &message, simtime)) {
+      PROFILE_BEGIN(t0);
+      proto->A_output(message);
+      PROFILE_END(PROF_A_OUTPUT, t0);
+      }
+   PERF_LEAVE(ph);
+}
 
+/* fecdeliver(): give B a packet the FEC decoder releases; one it rebuilt */
+/* arrives at B's transport layer only now                               */
+static void fecdeliver(packet, rebuilt)
+struct pkt *packet;
+int rebuilt;
+{
+   if (rebuilt)
+      B_transport += 1;
+   proto->B_input(*packet);
+}
 
+/* accountevent(): the counters and metrics of an event being handled, at */
+/* the current time.  A parallel run does this for all flows in order      */
+/* once a window is over, see parallel.c.                                  */
+void accountevent(evtype, AorB, id)
+int evtype, AorB, id;
+{
+   nprocessed++;
+   if (evtype == FROM_LAYER5) {
+      metrics_created(id, simtime);
+      nsim++;
+      if (AorB == A)
+         A_application += 1;
+      }
+   else if (evtype == FROM_LAYER3) {
+      if (AorB == B)
+         B_transport += 1;
+      }
+   else if (evtype == TIMER_INTERRUPT)
+      metrics_timeout();
+}
 
 void init(int seed)                         /* initialize the simulator */
 {
@@ -269,7 +1124,10 @@ void init(int seed)                         /* initialize the simulator */
    scanf("%d",&TRACE);
    */
 
-   srand(seed);              /* init random number generator */
+   /* init random number generator, in a state buffer of our own so that
+      snapshots can save it; this gives the same numbers as srand(seed) */
+   randactive = randstate[0];
+   initstate(seed, randactive, sizeof(randstate[0]));
    sum = 0.0;                /* test random number generator for students */
    for (i=0; i<1000; i++)
       sum=sum+jimsrand();    /* jimsrand() should be uniform in [0,1] */
@@ -281,12 +1139,49 @@ void init(int seed)                         /* initialize the simulator */
     exit(0);
     }
 
+   /* start from an empty simulation, init() runs once per protocol */
+   while (evq->nevents > 0)
+      freeevent(removeevent());
+   for (i=0; flows != NULL && i<nflows; i++) {
+      free(flows[i].idtimers[A]);
+      free(flows[i].idtimers[B]);
+      }
+   free(flows);
+   flows = (struct flow *)calloc(nflows, sizeof(struct flow));
+   for (i=0; i<nflows; i++) {
+      flows[i].rng[RNG_ARRIVALS] = ((unsigned long long)seed << 32) + 2*i;
+      flows[i].rng[RNG_MEDIUM] = ((unsigned long long)seed << 32) + 2*i + 1;
+      }
+   nsim = 0;
+   nprocessed = 0;
+   A_application = A_transport = B_application = B_transport = 0;
+   replay_rewind();
+
    ntolayer3 = 0;
    nlost = 0;
    ncorrupt = 0;
+   nreordered = 0;
+   for (i=0; i<2; i++) {
+      links[i].busy_until = 0;
+      free(links[i].departures);
+      links[i].departures = (sim_ticks_t *)malloc(queuelimit * sizeof(sim_ticks_t));
+      links[i].head = 0;
+      links[i].count = 0;
+      links[i].red_avg = 0.0;
+      links[i].red_count = 0;
+      links[i].npassed = 0;
+      links[i].ntaildrop = 0;
+      links[i].nearlydrop = 0;
+      links[i].maxqueue = 0;
+      links[i].sojourn = 0.0;
+      }
+
+   metrics_init(nsimmax, nflows);
 
-   time=0.0;                    /* initialize time to 0.0 */
-   generate_next_arrival();     /* initialize event list */
+   simtime=0;                   /* initialize time to 0 */
+   for (curflow=0; curflow<nflows; curflow++)
+      generate_next_arrival();  /* initialize event list */
+   curflow = 0;
 }
 
 /****************************************************************************/
@@ -302,6 +1197,24 @@ float jimsrand()
   return(x);
 }  
 
+/* simrand(): a float in range [0,1) from one of the streams of the flow */
+/* being handled (splitmix64).  A single flow draws everything from      */
+/* jimsrand(), as the emulator always has, whose range is [0,1]: the     */
+/* largest values of rand() round to 1 in a float.                       */
+float simrand(stream)
+int stream;
+{
+  unsigned long long z;
+
+  if (nflows == 1)
+     return jimsrand();
+  z = (flows[curflow].rng[stream] += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return (z >> 40) / 16777216.0;
+}
+
 /********************* EVENT HANDLINE ROUTINES *******/
 /*  The next set of routines handle the event list   */
 /*****************************************************/
@@ -309,20 +1222,36 @@ float jimsrand()
 void generate_next_arrival()
 {
    double x,log(),ceil();
-   struct event *evptr;
-    //char *malloc();
    float ttime;
    int tempint;
 
    if (TRACE>2)
        printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
  
-   x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
-                             /* having mean of lambda        */
-   evptr = (struct event *)malloc(sizeof(struct event));
-   evptr->evtime =  time + x;
+   if (!replay_arrival(&x))
+      x = traffic_gap(lambda);  /* by default uniform on [0,2*lambda] */
+                                /* having mean of lambda        */
+   record_arrival(x);
+   schedulearrival(x, 0);
+} 
+
+/* schedulearrival(): the next message of the flow arrives in x time    */
+/* units.  An extra one, from the saturated source, is outside the chain */
+/* of arrivals each message sets up for the next.                        */
+void schedulearrival(x, extra)
+double x;
+int extra;
+{
+   struct event *evptr;
+    //char *malloc();
+
+   evptr = newevent();
+   evptr->evtime =  simtime + SIM_TICKS(x);
    evptr->evtype =  FROM_LAYER5;
-   if (BIDIRECTIONAL && (jimsrand()>0.5) )
+   evptr->flow = curflow;
+   evptr->pktptr = NULL;
+   evptr->extra = extra;
+   if (BIDIRECTIONAL && (simrand(RNG_ARRIVALS)>0.5) )
       evptr->eventity = B;
     else
       evptr->eventity = A;
@@ -330,51 +1259,324 @@ void generate_next_arrival()
 } 
 
 
-void insertevent(p)
+/* evbefore(): heap order.  Events at the same time go flow by flow, and  */
+/* within a flow the one scheduled last goes first, as it always has.     */
+static int evbefore(p, q)
+   struct event *p, *q;
+{
+   if (p->evtime != q->evtime)
+      return p->evtime < q->evtime;
+   if (p->flow != q->flow)
+      return p->flow < q->flow;
+   return p->seq > q->seq;
+}
+
+static void heapset(p, i)
    struct event *p;
+   int i;
 {
-   struct event *q,*qold;
+   evq->heap[i] = p;
+   p->heapidx = i;
+}
 
+/* heapup() / heapdown(): move the event at i to its place in the heap */
+static void heapup(i)
+   int i;
+{
+   struct event *p = evq->heap[i];
+
+   while (i > 0 && evbefore(p, evq->heap[(i-1)/2])) {
+      heapset(evq->heap[(i-1)/2], i);
+      i = (i-1)/2;
+      }
+   heapset(p, i);
+}
+
+static void heapdown(i)
+   int i;
+{
+   struct event *p = evq->heap[i];
+   int c;
+
+   while ((c = 2*i + 1) < evq->nevents) {
+      if (c+1 < evq->nevents && evbefore(evq->heap[c+1], evq->heap[c]))
+         c++;
+      if (!evbefore(evq->heap[c], p))
+         break;
+      heapset(evq->heap[c], i);
+      i = c;
+      }
+   heapset(p, i);
+}
+
+/* heapreserve(): make room for n more events on the heap at once */
+void heapreserve(n)
+   int n;
+{
+   if (evq->nevents + n <= evq->size)
+      return;
+   if (evq->size == 0)
+      evq->size = 64;
+   while (evq->size < evq->nevents + n)
+      evq->size *= 2;
+   evq->heap = (struct event **)realloc(evq->heap, evq->size * sizeof(struct event *));
+}
+
+/* heapinsert(): add an event that already has its seq to the queue */
+void heapinsert(p)
+   struct event *p;
+{
+   heapreserve(1);
+   evq->heap[evq->nevents++] = p;
+   heapup(evq->nevents-1);
+}
+
+/* heapremove(): take the event at i off the heap */
+static void heapremove(i)
+   int i;
+{
+   struct event *last = evq->heap[--evq->nevents];
+
+   if (i == evq->nevents)
+      return;
+   heapset(last, i);
+   heapup(i);
+   heapdown(last->heapidx);
+}
+
+/* newevent() / freeevent(): events come from the pool of the queue, so */
+/* the packets and timers of a busy run seldom need malloc()              */
+struct event *newevent()
+{
+   struct event *p = evq->pool;
+
+   if (p == NULL)
+      p = (struct event *)malloc(sizeof(struct event));
+   else
+      evq->pool = p->nextfree;
+   p->fecgroup = -1;    /* only transmit() sends coded packets */
+   p->inframe = 0;      /* and frames */
+   return p;
+}
+
+void freeevent(p)
+   struct event *p;
+{
+   p->nextfree = evq->pool;
+   evq->pool = p;
+}
+
+void insertevent(p)
+   struct event *p;
+{
+   PROFILE_BEGIN(t0);
    if (TRACE>2) {
-      printf("            INSERTEVENT: time is %lf\n",time);
-      printf("            INSERTEVENT: future time will be %lf\n",p->evtime); 
+      printf("            INSERTEVENT: time is %lf\n",SIM_UNITS(simtime));
+      printf("            INSERTEVENT: future time will be %lf\n",SIM_UNITS(p->evtime)); 
       }
-   q = evlist;     /* q points to header of list in which p struct inserted */
-   if (q==NULL) {   /* list is empty */
-        evlist=p;
-        p->next=NULL;
-        p->prev=NULL;
-        }
-     else {
-        for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
-              qold=q; 
-        if (q==NULL) {   /* end of list */
-             qold->next = p;
-             p->prev = qold;
-             p->next = NULL;
-             }
-           else if (q==evlist) { /* front of list */
-             p->next=evlist;
-             p->prev=NULL;
-             p->next->prev=p;
-             evlist = p;
-             }
-           else {     /* middle of list */
-             p->next=q;
-             p->prev=q->prev;
-             q->prev->next=p;
-             q->prev=p;
-             }
-         }
+   p->seq = flows[p->flow].nextseq++;
+   heapinsert(p);
+   PROFILE_END(PROF_INSERTEVENT, t0);
 }
 
-void printevlist()
+/* nextevent(): the earliest event, left on the heap, or NULL */
+struct event *nextevent()
+{
+   return evq->nevents > 0 ? evq->heap[0] : NULL;
+}
+
+/* removeevent(): take the earliest event off the heap */
+struct event *removeevent()
+{
+   struct event *p;
+   PERF_ENTER(ph, PERF_DEQUEUE);
+
+   p = evq->heap[0];
+   heapremove(0);
+   if (p->evtype == FROM_LAYER3)
+      evq->ninflight[p->eventity]--;
+   PERF_LEAVE(ph);
+   return p;
+}
+
+/********************* SNAPSHOTS *******/
+/* sim_save(): write the state of the emulator for a snapshot.  Events    */
+/* keep their seq, so sim_restore() puts equal times back in order.       */
+void sim_save()
 {
   struct event *q;
+  int i, j, haspkt;
+
+  snapshot_write(&simtime, sizeof(simtime));
+  snapshot_write(&nsim, sizeof(nsim));
+  snapshot_write(&nprocessed, sizeof(nprocessed));
+  snapshot_write(&A_application, sizeof(A_application));
+  snapshot_write(&A_transport, sizeof(A_transport));
+  snapshot_write(&B_application, sizeof(B_application));
+  snapshot_write(&B_transport, sizeof(B_transport));
+  snapshot_write(&ntolayer3, sizeof(ntolayer3));
+  snapshot_write(&nlost, sizeof(nlost));
+  snapshot_write(&ncorrupt, sizeof(ncorrupt));
+  snapshot_write(&nreordered, sizeof(nreordered));
+
+  /* setstate() stores the position of the generator in its buffer */
+  setstate(randactive);
+  snapshot_write(randactive, sizeof(randstate[0]));
+
+  snapshot_write(&nflows, sizeof(nflows));
+  for (i=0; i<nflows; i++) {
+    snapshot_write(&flows[i].nsim, sizeof(int));
+    snapshot_write(&flows[i].done, sizeof(int));
+    snapshot_write(flows[i].lastarrival, sizeof(flows[i].lastarrival));
+    snapshot_write(&flows[i].nextseq, sizeof(long long));
+    snapshot_write(flows[i].rng, sizeof(flows[i].rng));
+    snapshot_write(&flows[i].onleft, sizeof(double));
+    snapshot_write(&flows[i].traceidx, sizeof(int));
+    snapshot_write(&flows[i].nextdelivery, sizeof(int));
+    snapshot_write(&flows[i].nskipped, sizeof(int));
+    }
+
+  for (i=0; i<2; i++) {
+    snapshot_write(&links[i].busy_until, sizeof(sim_ticks_t));
+    snapshot_write(&links[i].count, sizeof(int));
+    for (j=0; j<links[i].count; j++)
+      snapshot_write(&links[i].departures[(links[i].head + j) % queuelimit], sizeof(sim_ticks_t));
+    snapshot_write(&links[i].red_avg, sizeof(float));
+    snapshot_write(&links[i].red_count, sizeof(int));
+    snapshot_write(&links[i].npassed, sizeof(int));
+    snapshot_write(&links[i].ntaildrop, sizeof(int));
+    snapshot_write(&links[i].nearlydrop, sizeof(int));
+    snapshot_write(&links[i].maxqueue, sizeof(int));
+    snapshot_write(&links[i].sojourn, sizeof(double));
+    }
+
+  snapshot_write(&evq->nevents, sizeof(evq->nevents));
+  for (i=0; i<evq->nevents; i++) {
+    q = evq->heap[i];
+    snapshot_write(&q->evtime, sizeof(q->evtime));
+    snapshot_write(&q->evtype, sizeof(q->evtype));
+    snapshot_write(&q->eventity, sizeof(q->eventity));
+    snapshot_write(&q->flow, sizeof(q->flow));
+    snapshot_write(&q->seq, sizeof(q->seq));
+    haspkt = q->pktptr != NULL;
+    snapshot_write(&haspkt, sizeof(haspkt));
+    if (haspkt)
+      snapshot_write(q->pktptr, sizeof(struct pkt));
+    if (q->evtype == TIMER_INTERRUPT)
+      snapshot_write(&q->timerid, sizeof(q->timerid));
+    else if (q->evtype == FROM_LAYER5)
+      snapshot_write(&q->extra, sizeof(q->extra));
+    }
+}
+
+/* sim_restore(): replace the state of the emulator with a snapshot's */
+void sim_restore()
+{
+  struct event *p;
+  int i, j, n, haspkt;
+
+  while (evq->nevents > 0)
+    freeevent(removeevent());
+
+  snapshot_read(&simtime, sizeof(simtime));
+  snapshot_read(&nsim, sizeof(nsim));
+  snapshot_read(&nprocessed, sizeof(nprocessed));
+  snapshot_read(&A_application, sizeof(A_application));
+  snapshot_read(&A_transport, sizeof(A_transport));
+  snapshot_read(&B_application, sizeof(B_application));
+  snapshot_read(&B_transport, sizeof(B_transport));
+  snapshot_read(&ntolayer3, sizeof(ntolayer3));
+  snapshot_read(&nlost, sizeof(nlost));
+  snapshot_read(&ncorrupt, sizeof(ncorrupt));
+  snapshot_read(&nreordered, sizeof(nreordered));
+
+  /* setstate() on the buffer in use would overwrite the saved position
+     with the current one, so load into the other buffer */
+  randactive = randactive == randstate[0] ? randstate[1] : randstate[0];
+  snapshot_read(randactive, sizeof(randstate[0]));
+  setstate(randactive);
+
+  snapshot_read(&n, sizeof(n));
+  if (n != nflows) {
+    fprintf(stderr, "Snapshot has %d flows, not %d\n", n, nflows);
+    exit(-1);
+    }
+  for (i=0; i<nflows; i++) {
+    snapshot_read(&flows[i].nsim, sizeof(int));
+    snapshot_read(&flows[i].done, sizeof(int));
+    snapshot_read(flows[i].lastarrival, sizeof(flows[i].lastarrival));
+    snapshot_read(&flows[i].nextseq, sizeof(long long));
+    snapshot_read(flows[i].rng, sizeof(flows[i].rng));
+    snapshot_read(&flows[i].onleft, sizeof(double));
+    snapshot_read(&flows[i].traceidx, sizeof(int));
+    snapshot_read(&flows[i].nextdelivery, sizeof(int));
+    snapshot_read(&flows[i].nskipped, sizeof(int));
+    flows[i].timers[A] = flows[i].timers[B] = NULL;
+    for (j=0; j<2; j++)
+      if (flows[i].nidtimers[j] > 0)
+        memset(flows[i].idtimers[j], 0, flows[i].nidtimers[j] * sizeof(struct event *));
+    }
+
+  for (i=0; i<2; i++) {
+    snapshot_read(&links[i].busy_until, sizeof(sim_ticks_t));
+    snapshot_read(&n, sizeof(int));
+    if (n > queuelimit) {
+      fprintf(stderr, "Snapshot has %d packets queued at the link, more than --queue-limit\n", n);
+      exit(-1);
+      }
+    links[i].head = 0;
+    links[i].count = n;
+    for (j=0; j<n; j++)
+      snapshot_read(&links[i].departures[j], sizeof(sim_ticks_t));
+    snapshot_read(&links[i].red_avg, sizeof(float));
+    snapshot_read(&links[i].red_count, sizeof(int));
+    snapshot_read(&links[i].npassed, sizeof(int));
+    snapshot_read(&links[i].ntaildrop, sizeof(int));
+    snapshot_read(&links[i].nearlydrop, sizeof(int));
+    snapshot_read(&links[i].maxqueue, sizeof(int));
+    snapshot_read(&links[i].sojourn, sizeof(double));
+    }
+
+  snapshot_read(&n, sizeof(n));
+  evq->ninflight[A] = evq->ninflight[B] = 0;
+  for (i=0; i<n; i++) {
+    p = newevent();
+    snapshot_read(&p->evtime, sizeof(p->evtime));
+    snapshot_read(&p->evtype, sizeof(p->evtype));
+    snapshot_read(&p->eventity, sizeof(p->eventity));
+    snapshot_read(&p->flow, sizeof(p->flow));
+    snapshot_read(&p->seq, sizeof(p->seq));
+    snapshot_read(&haspkt, sizeof(haspkt));
+    if (p->flow < 0 || p->flow >= nflows || p->eventity < A || p->eventity > B) {
+      fprintf(stderr, "Snapshot has a bad event\n");
+      exit(-1);
+      }
+    p->pktptr = NULL;
+    if (haspkt) {
+      p->pktptr = &p->pkt;
+      snapshot_read(p->pktptr, sizeof(struct pkt));
+      }
+    p->timerid = -1;
+    p->extra = 0;
+    if (p->evtype == TIMER_INTERRUPT)
+      snapshot_read(&p->timerid, sizeof(p->timerid));
+    else if (p->evtype == FROM_LAYER5)
+      snapshot_read(&p->extra, sizeof(p->extra));
+    if (p->evtype == FROM_LAYER3)
+      evq->ninflight[p->eventity]++;
+    else if (p->evtype == TIMER_INTERRUPT)
+      *timerslot(p->flow, p->eventity, p->timerid) = p;
+    heapinsert(p);
+    }
+}
+
+void printevlist()
+{
   int i;
   printf("--------------\nEvent List Follows:\n");
-  for(q = evlist; q!=NULL; q=q->next) {
-    printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
+  for(i = 0; i < evq->nevents; i++) {
+    printf("Event time: %f, type: %d entity: %d flow: %d\n",SIM_UNITS(evq->heap[i]->evtime),
+           evq->heap[i]->evtype,evq->heap[i]->eventity,evq->heap[i]->flow);
     }
   printf("--------------\n");
 }
@@ -383,84 +1585,420 @@ void printevlist()
 
 /********************** Student-callable ROUTINES ***********************/
 
-/* called by students routine to cancel a previously-started timer */
-void stoptimer(AorB)
-int AorB;  /* A or B is trying to stop timer */
+/* timerslot(): where flow f keeps the pending event of a timer of AorB,  */
+/* id -1 being the one of starttimer().  Named timers get room as they are */
+/* first used, so the slot of a running timer is found in O(1).            */
+static struct event **timerslot(f, AorB, id)
+int f, AorB, id;
 {
- struct event *q,*qold;
+ struct flow *fl = &flows[f];
+ int n = fl->nidtimers[AorB];
 
- if (TRACE>2)
-    printf("          STOP TIMER: stopping timer at %f\n",time);
-/* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
- for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-       /* remove this event */
-       if (q->next==NULL && q->prev==NULL)
-             evlist=NULL;         /* remove first and only event on list */
-          else if (q->next==NULL) /* end of list - there is one in front */
-             q->prev->next = NULL;
-          else if (q==evlist) { /* front of list - there must be event after */
-             q->next->prev=NULL;
-             evlist = q->next;
-             }
-           else {     /* middle of list */
-             q->next->prev = q->prev;
-             q->prev->next =  q->next;
-             }
-       free(q);
-       return;
-     }
-  printf("Warning: unable to cancel your timer. It wasn't running.\n");
+ if (id < 0)
+    return &fl->timers[AorB];
+ if (id >= n) {
+    fl->nidtimers[AorB] = n ? 2*n : 64;
+    while (fl->nidtimers[AorB] <= id)
+       fl->nidtimers[AorB] *= 2;
+    fl->idtimers[AorB] = (struct event **)realloc(fl->idtimers[AorB],
+                               fl->nidtimers[AorB] * sizeof(struct event *));
+    memset(fl->idtimers[AorB] + n, 0, (fl->nidtimers[AorB] - n) * sizeof(struct event *));
+    }
+ return &fl->idtimers[AorB][id];
 }
 
-
-void starttimer(AorB,increment)
-int AorB;  /* A or B is trying to stop timer */
-float increment;
+/* canceltimer(): stop timer id of AorB, returns 0 if it wasn't running */
+static int canceltimer(AorB, id)
+int AorB, id;
 {
+ struct event **timer = timerslot(curflow, AorB, id);
+
+ if (TRACE>2)
+    printf("          STOP TIMER: stopping timer at %f\n",SIM_UNITS(simtime));
+ if (*timer == NULL)
+    return 0;
+ /* the flow knows its timer event, so no need to search for it */
+ heapremove((*timer)->heapidx);
+ freeevent(*timer);
+ *timer = NULL;
+ return 1;
+}
 
- struct event *q;
+/* settimer(): start timer id of AorB, returns 0 if it was already running */
+static int settimer(AorB, id, increment)
+int AorB, id;
+sim_ticks_t increment;
+{
  struct event *evptr;
+ struct event **timer = timerslot(curflow, AorB, id);
  //char *malloc();
 
  if (TRACE>2)
-    printf("          START TIMER: starting timer at %f\n",time);
- /* be nice: check to see if timer is already started, if so, then  warn */
-/* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-   for (q=evlist; q!=NULL ; q = q->next)  
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      printf("Warning: attempt to start a timer that is already started\n");
-      return;
-      }
+    printf("          START TIMER: starting timer at %f\n",SIM_UNITS(simtime));
+ if (*timer != NULL)
+    return 0;
  
 /* create future event for when timer goes off */
-   evptr = (struct event *)malloc(sizeof(struct event));
-   evptr->evtime =  time + increment;
+   evptr = newevent();
+   evptr->evtime =  simtime + increment;
    evptr->evtype =  TIMER_INTERRUPT;
    evptr->eventity = AorB;
+   evptr->flow = curflow;
+   evptr->pktptr = NULL;
+   evptr->timerid = id;
    insertevent(evptr);
-} 
+   *timer = evptr;
+   return 1;
+}
+
+/* called by students routine to cancel a previously-started timer */
+void stoptimer(AorB)
+int AorB;  /* A or B is trying to stop timer */
+{
+ if (!canceltimer(AorB, -1))
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+}
+
+
+void starttimer_ticks(AorB,increment)
+int AorB;  /* A or B is trying to stop timer */
+sim_ticks_t increment;
+{
+ /* be nice: check to see if timer is already started, if so, then  warn */
+ if (!settimer(AorB, -1, increment))
+    printf("Warning: attempt to start a timer that is already started\n");
+}
+
+/* increment in time units, rounded to the nearest tick */
+void starttimer(AorB,increment)
+int AorB;
+double increment;
+{
+   starttimer_ticks(AorB, SIM_TICKS(increment));
+}
+
+/* named timers: any number per entity, told apart by an id >= 0 that is */
+/* given to A_timerinterrupt_id() when the timer goes off                */
+void starttimer_id(AorB,id,increment)
+int AorB, id;
+double increment;
+{
+ if (id < 0 || proto->A_timerinterrupt_id == NULL) {
+    printf("Warning: named timers need an id >= 0 and A_timerinterrupt_id()\n");
+    return;
+    }
+ if (!settimer(AorB, id, SIM_TICKS(increment)))
+    printf("Warning: attempt to start timer %d that is already started\n", id);
+}
+
+void stoptimer_id(AorB,id)
+int AorB, id;
+{
+ if (id < 0 || !canceltimer(AorB, id))
+    printf("Warning: unable to cancel your timer %d. It wasn't running.\n", id);
+}
+
+
+/************************ BOTTLENECK LINK ***************/
+/* linkenqueue(): offer a packet from AorB to its bottleneck link at the   */
+/* current time.  Returns 1 and sets *departure to the time the packet has */
+/* been sent onto the medium, or returns 0 if the queue dropped it.        */
+int linkenqueue(AorB, departure)
+int AorB;
+sim_ticks_t *departure;
+{
+ struct link *l = &links[AorB];
+ float pb, pa, idle;
+
+ /* forget the packets that have left the link by now */
+ while (l->count > 0 && l->departures[l->head] <= simtime) {
+    l->head = (l->head + 1) % queuelimit;
+    l->count--;
+    }
+
+ if (red) {
+    /* average decays over the time the link has been idle */
+    if (l->count == 0 && l->busy_until < simtime) {
+       idle = SIM_UNITS(simtime - l->busy_until) * linkrate;
+       while (idle-- > 0 && l->red_avg > 0.001)
+          l->red_avg *= 1 - red_weight;
+       }
+    l->red_avg = (1 - red_weight)*l->red_avg + red_weight*l->count;
+    if (l->red_avg >= red_maxth && l->count < queuelimit) {
+       l->nearlydrop++;
+       l->red_count = 0;
+       if (TRACE>0)
+          printf("          TOLAYER3: packet dropped early by link\n");
+       return 0;
+       }
+    if (l->red_avg >= red_minth && l->count < queuelimit) {
+       pb = red_maxp * (l->red_avg - red_minth) / (red_maxth - red_minth);
+       pa = l->red_count*pb < 1 ? pb / (1 - l->red_count*pb) : 1;
+       l->red_count++;
+       if (simrand(RNG_MEDIUM) < pa) {
+          l->nearlydrop++;
+          l->red_count = 0;
+          if (TRACE>0)
+             printf("          TOLAYER3: packet dropped early by link\n");
+          return 0;
+          }
+       }
+    else
+       l->red_count = 0;
+    }
+
+ if (l->count >= queuelimit) {
+    l->ntaildrop++;
+    if (TRACE>0)
+       printf("          TOLAYER3: packet dropped by full link queue\n");
+    return 0;
+    }
+
+ if (l->busy_until < simtime)
+    l->busy_until = simtime;
+ l->busy_until += SIM_TICKS(1 / linkrate);
+ l->departures[(l->head + l->count) % queuelimit] = l->busy_until;
+ l->count++;
+ if (l->count > l->maxqueue)
+    l->maxqueue = l->count;
+ l->npassed++;
+ l->sojourn += SIM_UNITS(l->busy_until - simtime);
+ *departure = l->busy_until;
+ return 1;
+}
+
+void printlinkstats()
+{
+  int i;
+  for (i=0; i<2; i++)
+    printf(" link %c->%c: %d packets queued, %d tail drops, %d early drops, max queue %d, mean queue %f\n",
+           'A'+i, 'A'+(i+1)%2, links[i].npassed, links[i].ntaildrop,
+           links[i].nearlydrop, links[i].maxqueue,
+           simtime > 0 ? links[i].sojourn / SIM_UNITS(simtime) : 0.0);
+}
 
 
 /************************** TOLAYER3 ***************/
+/* channeldecide(): draw the fate of a packet entering the medium, in the */
+/* same order the emulator has always drawn its random numbers            */
+void channeldecide(d)
+struct chan_decision *d;
+{
+ float x;
+
+ d->lost = 0;
+ d->reordered = 0;
+ d->corrupt = CORRUPT_NONE;
+ d->delay = 0.0;
+
+ /* simulate losses: */
+ if (simrand(RNG_MEDIUM) < lossprob)  {
+    d->lost = 1;
+    return;
+    }
+
+ /* delay on top of the arrival base, see tolayer3() */
+ if (reorderprob > 0.0 && simrand(RNG_MEDIUM) < reorderprob) {
+    d->reordered = 1;
+    x = 1 + 9*simrand(RNG_MEDIUM);
+    d->delay = x + reordermax*simrand(RNG_MEDIUM);
+    }
+ else
+    d->delay = 1 + 9*simrand(RNG_MEDIUM);
+
+ /* simulate corruption: */
+ if (simrand(RNG_MEDIUM) < corruptprob)  {
+    if ( (x = simrand(RNG_MEDIUM)) < .75)
+       d->corrupt = CORRUPT_PAYLOAD;
+      else if (x < .875)
+       d->corrupt = CORRUPT_SEQNUM;
+      else
+       d->corrupt = CORRUPT_ACKNUM;
+    }
+}
+
 void tolayer3(AorB,packet)
 int AorB;  /* A or B is trying to stop timer */
 struct pkt packet;
+{
+ /* the arrival takes its place among the events of the flow now, even
+    when a parallel run schedules it later */
+ long long seq;
+ PERF_ENTER(ph, PERF_TOLAYER3);
+ PROFILE_BEGIN(t0);
+
+ if (!udp_send(AorB, &packet, 1) && !ring_send(AorB, &packet, 1)) {
+    seq = flows[curflow].nextseq++;
+    if (!parallel_defer_packets(AorB, &packet, 1, seq))
+       sendpacket(AorB, &packet, seq);
+    }
+ PROFILE_END(PROF_TOLAYER3, t0);
+ PERF_LEAVE(ph);
+}
+
+/* tolayer3_batch(): hand n packets to layer 3 in one call, with the same */
+/* result as n calls of tolayer3() in a row                               */
+void tolayer3_batch(AorB,pkts,n)
+int AorB;
+const struct pkt *pkts;
+int n;
+{
+ long long seq = flows[curflow].nextseq;
+ int i;
+ PERF_ENTER(ph, PERF_TOLAYER3);
+ PROFILE_BEGIN(t0);
+
+ if (n > 0 && !udp_send(AorB, pkts, n) && !ring_send(AorB, pkts, n)) {
+    flows[curflow].nextseq += n;
+    if (!parallel_defer_packets(AorB, pkts, n, seq)) {
+       heapreserve(n);
+       for (i=0; i<n; i++)
+          sendpacket(AorB, &pkts[i], seq + i);
+       }
+    }
+ PROFILE_END(PROF_TOLAYER3_BATCH, t0);
+ PERF_LEAVE(ph);
+}
+
+/* corruptpacket(): damage a packet the way the medium decided to */
+static void corruptpacket(p, how)
+struct pkt *p;
+int how;
+{
+ ncorrupt++;
+ if (how == CORRUPT_PAYLOAD)
+    p->payload[0]='Z';   /* corrupt payload */
+   else if (how == CORRUPT_SEQNUM)
+    p->seqnum = 999999;
+   else
+    p->acknum = 999999;
+ if (TRACE>0)    
+    printf("          TOLAYER3: packet being corrupted\n");
+}
+
+/* impairpacket(): count a packet handed to layer 3 and put a copy of it  */
+/* through the losses and corruption of the medium, for backends that     */
+/* carry packets themselves without a link or delays (see ring.c).        */
+/* Returns 0 if the packet is lost.                                       */
+int impairpacket(AorB,packet,copy)
+int AorB;
+const struct pkt *packet;
+struct pkt *copy;
+{
+ struct chan_decision d;
+
+ ntolayer3++;
+ if(AorB == 0) A_transport += 1;
+ metrics_sent(AorB, packet);
+
+ if (!replay_packet(AorB, &d))
+    channeldecide(&d);
+ record_packet(AorB, &d);
+ if (d.lost)  {
+    nlost++;
+    if (TRACE>0)
+       printf("          TOLAYER3: packet being lost\n");
+    return 0;
+    }
+ *copy = *packet;
+ if (d.corrupt != CORRUPT_NONE)
+    corruptpacket(copy, d.corrupt);
+ return 1;
+}
+
+/* scheduletimeout(): schedule an event of the simulator at A of the     */
+/* current flow, increment time units from now                         */
+static void scheduletimeout(evtype, increment, fecgroup)
+int evtype;
+float increment;
+int fecgroup;
+{
+ struct event *evptr = newevent();
+
+ evptr->evtime = simtime + SIM_TICKS(increment);
+ evptr->evtype = evtype;
+ evptr->eventity = A;
+ evptr->flow = curflow;
+ evptr->pktptr = NULL;
+ evptr->timerid = -1;
+ evptr->fecgroup = fecgroup;
+ insertevent(evptr);
+}
+
+/* sendpacket(): put a packet handed to layer 3 on the medium, followed */
+/* by the parity of its group when it completes one (see fec.c)          */
+void sendpacket(AorB,packet,seq)
+int AorB;
+const struct pkt *packet;
+long long seq;
+{
+ struct pkt parity;
+ int group = -1, index = 0, n = 0;
+
+ if (fec_k > 0 && AorB == A) {
+    n = fec_encode(curflow, packet, &group, &index, &parity);
+    /* the first packet of a group sets when it closes at the latest */
+    if (index == 0 && fec_wait > 0.0)
+       scheduletimeout(FEC_TIMEOUT, fec_wait, group);
+    }
+ transmit(AorB, packet, seq, group, index);
+ if (n > 0)
+    transmit(AorB, &parity, flows[curflow].nextseq++, group, -n);
+}
+
+/* transmit(): put a packet on the medium, with its FEC group and index */
+static void transmit(AorB,packet,seq,fecgroup,fecindex)
+int AorB;
+const struct pkt *packet;
+long long seq;
+int fecgroup, fecindex;
 {
  struct pkt *mypktptr;
- struct event *evptr,*q;
+ struct event *evptr;
+ struct chan_decision d;
  //char *malloc();
- float lastime, x, jimsrand();
- int i;
+ sim_ticks_t lastime, departure, *lastarrival;
+ int i, framing;
 
 
  ntolayer3++;
 
- if(AorB == 0) A_transport += 1;
+ /* a parity packet is not the protocol's */
+ if (fecgroup < 0 || fecindex >= 0) {
+    if(AorB == 0) A_transport += 1;
+    metrics_sent(AorB, packet);
+    }
+
+ /* queue behind the bottleneck link, if there is one */
+ departure = simtime;
+ if (linkrate > 0.0 && !linkenqueue(AorB, &departure)) {
+    if (fecgroup >= 0)
+       fec_lost(curflow, fecgroup, fecindex);
+    return;
+    }
+
+ /* the medium's decisions come from a recording or are drawn now, */
+ /* once for a frame of packets with --aggregate                    */
+ framing = agg_max > 0;
+ if (framing && framelen[AorB] > 0 && framelen[AorB] < agg_max)
+    d = framedecision[AorB];
+ else {
+    if (!replay_packet(AorB, &d))
+       channeldecide(&d);
+    record_packet(AorB, &d);
+    framelen[AorB] = 0;
+    }
+ if (framing) {
+    agg_framed(framelen[AorB] == 0);
+    framedecision[AorB] = d;
+    framelen[AorB]++;
+    }
 
  /* simulate losses: */
- if (jimsrand() < lossprob)  {
+ if (d.lost)  {
       nlost++;
+      if (fecgroup >= 0)
+         fec_lost(curflow, fecgroup, fecindex);
       if (TRACE>0)    
 	printf("          TOLAYER3: packet being lost\n");
       return;
@@ -468,12 +2006,13 @@ struct pkt packet;
 
 /* make a copy of the packet student just gave me since he/she may decide */
 /* to do something with the packet after we return back to him/her */ 
- mypktptr = (struct pkt *)malloc(sizeof(struct pkt));
- mypktptr->seqnum = packet.seqnum;
- mypktptr->acknum = packet.acknum;
- mypktptr->checksum = packet.checksum;
+ evptr = newevent();
+ mypktptr = &evptr->pkt;
+ mypktptr->seqnum = packet->seqnum;
+ mypktptr->acknum = packet->acknum;
+ mypktptr->checksum = packet->checksum;
  for (i=0; i<20; i++)
-    mypktptr->payload[i] = packet.payload[i];
+    mypktptr->payload[i] = packet->payload[i];
  if (TRACE>2)  {
    printf("          TOLAYER3: seq: %d, ack %d, check: %d ", mypktptr->seqnum,
 	  mypktptr->acknum,  mypktptr->checksum);
@@ -483,44 +2022,128 @@ struct pkt packet;
    }
 
 /* create future event for arrival of packet at the other side */
-  evptr = (struct event *)malloc(sizeof(struct event));
   evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
   evptr->eventity = (AorB+1) % 2; /* event occurs at other entity */
   evptr->pktptr = mypktptr;       /* save ptr to my copy of packet */
+  evptr->flow = curflow;
+  evptr->fecgroup = fecgroup;
+  evptr->fecindex = fecindex;
 /* finally, compute the arrival time of packet at the other end.
    medium can not reorder, so make sure packet arrives between 1 and 10
-   time units after the latest arrival time of packets
-   currently in the medium on their way to the destination */
- lastime = time;
-/* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next) */
- for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==FROM_LAYER3  && q->eventity==evptr->eventity) ) 
-      lastime = q->evtime;
- evptr->evtime =  lastime + 1 + 9*jimsrand();
- 
-
+   time units after the latest arrival time of packets of the flow
+   currently in the medium on their way to the destination.
+   In-order arrivals only ever grow, so the latest one is kept per entity
+   instead of scanning the event list for it.
+   In reorder mode a packet may skip that constraint and take up to
+   reordermax extra time units, letting later packets overtake it */
+ evptr->inframe = framing && framelen[AorB] > 1;
+ if (evptr->inframe) {
+    /* the rest of a frame comes out right behind its first packet */
+    evptr->evtime = framearrival[AorB] + 1;
+    if (evptr->evtime < departure)
+       evptr->evtime = departure;
+    if (!d.reordered)
+       flows[curflow].lastarrival[evptr->eventity] = evptr->evtime;
+  }
+  else if (d.reordered) {
+    nreordered++;
+    evptr->evtime = departure + SIM_TICKS(d.delay);
+    if (TRACE>0)
+	printf("          TOLAYER3: packet being reordered\n");
+  }
+  else {
+    lastarrival = flows[curflow].lastarrival;
+    lastime = departure;
+    if (lastarrival[evptr->eventity] > lastime)
+      lastime = lastarrival[evptr->eventity];
+    evptr->evtime =  lastime + SIM_TICKS(d.delay);
+    lastarrival[evptr->eventity] = evptr->evtime;
+  }
+ framearrival[AorB] = evptr->evtime;
 
  /* simulate corruption: */
- if (jimsrand() < corruptprob)  {
-    ncorrupt++;
-    if ( (x = jimsrand()) < .75)
-       mypktptr->payload[0]='Z';   /* corrupt payload */
-      else if (x < .875)
-       mypktptr->seqnum = 999999;
-      else
-       mypktptr->acknum = 999999;
-    if (TRACE>0)    
-	printf("          TOLAYER3: packet being corrupted\n");
-    }  
+ if (d.corrupt != CORRUPT_NONE)
+    corruptpacket(mypktptr, d.corrupt);
 
   if (TRACE>2)  
      printf("          TOLAYER3: scheduling arrival on other side\n");
-  insertevent(evptr);
+  if (TRACE>2) {
+     printf("            INSERTEVENT: time is %lf\n",SIM_UNITS(simtime));
+     printf("            INSERTEVENT: future time will be %lf\n",SIM_UNITS(evptr->evtime)); 
+     }
+  evptr->seq = seq;
+  evq->ninflight[evptr->eventity]++;
+  heapinsert(evptr);
 } 
 
 void tolayer5(AorB,datasent)
   int AorB;
   char datasent[20];
+{
+  if (!parallel_defer_data(AorB, datasent))
+     deliverdata(AorB, datasent);
+}
+
+/* verifydelivery(): check that B of the current flow delivers messages of */
+/* its own A exactly once and in order, by the ids tagged in them, and stop */
+/* the run at the first that is not.  The messages skipped are counted; a  */
+/* protocol that drops messages (proto->drops, as ABT drops those it has   */
+/* no room for) may skip them, others may not.  Messages not delivered by  */
+/* the end of the run are not skipped: the sender may still be on them.    */
+static void verifydelivery(datasent)
+  char datasent[];
+{
+  struct flow *fl = &flows[curflow];
+  int id = metrics_id(datasent);
+  int first = curflow*nsimmax;
+
+  if (id > first + fl->nextdelivery && id < first + nsimmax) {
+     fl->nskipped += id - first - fl->nextdelivery;
+     if (!proto->drops) {
+        fflush(stdout);
+        fprintf(stderr, "Delivery check failed: flow %d delivered message %d at time %f, skipping messages %d to %d\n",
+                curflow, id, SIM_UNITS(simtime), first + fl->nextdelivery, id - 1);
+        exit(-1);
+        }
+     }
+  if (id < first + fl->nextdelivery || id >= first + nsimmax) {
+     fflush(stdout);
+     if (id < 0)
+        fprintf(stderr, "Delivery check failed: flow %d delivered a message with no valid id at time %f\n",
+                curflow, SIM_UNITS(simtime));
+     else if (id < first || id >= first + nsimmax)
+        fprintf(stderr, "Delivery check failed: flow %d delivered message %d of another flow at time %f\n",
+                curflow, id, SIM_UNITS(simtime));
+     else
+        fprintf(stderr, "Delivery check failed: flow %d delivered message %d at time %f, after message %d (duplicate or out of order)\n",
+                curflow, id, SIM_UNITS(simtime), first + fl->nextdelivery - 1);
+     exit(-1);
+     }
+  fl->nextdelivery = id - first + 1;
+}
+
+/* printskipped(): report the messages B skipped, by flow */
+static void printskipped()
+{
+  int f, total = 0;
+
+  for (f = 0; f < nflows; f++)
+     total += flows[f].nskipped;
+  if (total == 0)
+     return;
+  printf(" Delivery: %d messages skipped by B", total);
+  if (nflows > 1) {
+     printf(" (flow");
+     for (f = 0; f < nflows; f++)
+        printf(" %d: %d%s", f, flows[f].nskipped, f < nflows - 1 ? "," : ")");
+     }
+  printf("\n");
+}
+
+/* deliverdata(): count data handed to layer 5 */
+void deliverdata(AorB,datasent)
+  int AorB;
+  char datasent[];
 {
   int i;  
   if (TRACE>2) {
@@ -529,7 +2152,11 @@ void tolayer5(AorB,datasent)
         printf("%c",datasent[i]);
      printf("\n");
    }
-  if(AorB == 1) B_application += 1;
+  if(AorB == 1) {
+     B_application += 1;
+     verifydelivery(datasent);
+     }
+  metrics_delivered(AorB, datasent, simtime);
 }
 
 int getwinsize()
@@ -537,7 +2164,30 @@ int getwinsize()
 	return win_size;
 }
 
-float get_sim_time()
+/* sequence numbers run from 0 to 2^getseqbits()-1, then wrap around */
+int getseqbits()
+{
+	return seqbits;
+}
+
+/* flow of the callback being run, from 0 to getnflows()-1 */
+int getflow()
+{
+	return curflow;
+}
+
+int getnflows()
+{
+	return nflows;
+}
+
+/* time in time units, kept for code written against the float API */
+double get_sim_time()
+{
+	return SIM_UNITS(simtime);
+}
+
+sim_ticks_t get_sim_ticks()
 {
-	return time;
+	return simtime;
 }
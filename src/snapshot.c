@@ -0,0 +1,130 @@
+#include "../include/snapshot.h"
+#include "../include/simulator.h"
+#include <stdio.h>
+#include <string.h>
+
+/**
+* Snapshot file handling.
+*
+* A snapshot is a header followed by the state of the simulator core, the
+* metrics and the protocol, each written by its own module through
+* snapshot_write() and read back in the same order through
+* snapshot_read(). Values are stored in native byte order, so snapshots
+* are meant to be restored on the machine and build that wrote them.
+*/
+
+#define SNAPSHOT_MAGIC "TLSIMSNP"
+#define SNAPSHOT_VERSION 8
+
+extern int win_size;
+
+static FILE *fp = NULL;
+static int failed;
+
+struct snapshot_header {
+    char magic[8];
+    int version;
+    int win_size;
+    char protocol[32];
+};
+
+void snapshot_write(const void *data, int len) {
+    if (len > 0 && fwrite(data, len, 1, fp) != 1) {
+        failed = 1;
+    }
+}
+
+void snapshot_read(void *data, int len) {
+    if (failed || (len > 0 && fread(data, len, 1, fp) != 1)) {
+        failed = 1;
+        memset(data, 0, len);
+    }
+}
+
+/**
+* Function to write the current simulation state
+*
+* @param filename snapshot file
+* @param protocol name of the protocol being simulated
+* @return 0 on success, -1 on error
+*/
+int snapshot_save(const char *filename, const char *protocol) {
+    struct snapshot_header header;
+
+    fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    failed = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.win_size = win_size;
+    strncpy(header.protocol, protocol, sizeof(header.protocol) - 1);
+    snapshot_write(&header, sizeof(header));
+
+    sim_save();
+    metrics_save();
+    proto->save();
+    snapshot_write(SNAPSHOT_MAGIC, 8);
+
+    if (fclose(fp) != 0) {
+        failed = 1;
+    }
+    fp = NULL;
+    if (failed) {
+        fprintf(stderr, "%s: could not write snapshot\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+* Function to replace the current simulation state with a snapshot.
+* The simulator and protocol must have been initialised already.
+*
+* @param filename snapshot file
+* @param protocol name of the protocol being simulated
+* @return 0 on success, -1 on error
+*/
+int snapshot_load(const char *filename, const char *protocol) {
+    struct snapshot_header header;
+    char trailer[8];
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    failed = 0;
+
+    snapshot_read(&header, sizeof(header));
+    if (failed || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+            || header.version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "%s: not a snapshot of this simulator version\n", filename);
+        fclose(fp);
+        return -1;
+    }
+    if (strncmp(header.protocol, protocol, sizeof(header.protocol)) != 0
+            || header.win_size != win_size) {
+        fprintf(stderr, "%s: snapshot of %s with window %d, not %s with window %d\n",
+                filename, header.protocol, header.win_size, protocol, win_size);
+        fclose(fp);
+        return -1;
+    }
+
+    sim_restore();
+    metrics_restore();
+    proto->restore();
+    snapshot_read(trailer, 8);
+    fclose(fp);
+    fp = NULL;
+
+    if (failed || memcmp(trailer, SNAPSHOT_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: snapshot is truncated or corrupt\n", filename);
+        return -1;
+    }
+    return 0;
+}
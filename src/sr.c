@@ -2,11 +2,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <limits.h>
 
 #define PAYLOAD_SIZE 20
 #define TIMEOUT 12.0
-#define NUM_MSGS 1500
+#define BACKLOG_SIZE 64
 
 /* ******************************************************************
  ALTERNATING BIT AND GO-BACK-N NETWORK EMULATOR: VERSION 1.1  J.F.Kurose
@@ -27,28 +26,41 @@
 *
 */
 
-/* software timer queue */
-typedef struct timeout {
-    float start_time; // the time when the timer started
-    int seqnum;
-    struct timeout *next;
-} timeout_t;
-
-timeout_t *head = NULL;
-
-/* A's state variables*/
-static int winsize_a;
-static int base_a;
-static int end_a;
-static int nextseqnum;
-static struct pkt *sndpkt = NULL;
-
-/* B's state variables*/
-static int winsize_b;
-static int base_b;
-static struct pkt *recvpkt = NULL;
-static int *undelivered = NULL;
-static int *received = NULL;
+/* per-flow state, one copy for each flow of the simulation */
+struct flow_state {
+    /* A's state variables*/
+    int winsize_a;
+    int base_a;             // oldest unacknowledged seqnum
+    int nextseqnum;         // seqnum of the next packet sent for the first time
+    struct pkt *sndpkt;     // the window, a packet at seqnum % sndpkt_size
+    char *acked;            // per packet, the sent packets have a timer each until acked
+    int sndpkt_size;
+    struct msg *backlog;    // messages waiting for room in the window
+    int backlog_head;
+    int backlog_count;
+    int backlog_size;
+
+    /* B's state variables*/
+    int winsize_b;
+    int base_b;
+    struct pkt *recvpkt;    // the window, a packet at seqnum % recv_size
+    char *buffered;         // per packet, received and not delivered yet
+    int recv_size;
+    int nbuffered_b;
+};
+static struct flow_state *flows = NULL;
+static __thread struct flow_state *st;   // state of the flow being run, per thread
+static unsigned seqmask;                 // seqnums count modulo seqmask + 1
+
+/**
+* Function to switch to the state of the flow the simulator is running
+*/
+static void select_flow() {
+    if (flows == NULL) {
+        flows = calloc(getnflows(), sizeof(struct flow_state));
+    }
+    st = &flows[getflow()];
+}
 
 /**
 * Checksum function.
@@ -67,96 +79,50 @@ static int checksum(struct pkt *data) {
 }
 
 /**
-* Function to set timer for a packet with seqnum
+* Function to add to a seqnum, modulo the sequence space
 *
-* @param seqnum sequence number of the packet
+* @param seqnum sequence number
+* @param n how much to add
 */
-void start_timer(int seqnum) {
-    printf("%s: seqnum:%d\n", __func__, seqnum);
-
-    // create an entry
-    timeout_t *new = malloc(sizeof(timeout_t));
-    new->start_time = get_sim_time();
-    new->seqnum = seqnum;
-    new->next = NULL;
-
-    // add it to the queue
-    if (head == NULL) {
-        head = new;
+static int seq_add(int seqnum, int n) {
+    return ((unsigned)seqnum + n) & seqmask;
+}
 
-        // start the HW timer
-        starttimer(0, TIMEOUT);
-        printf("%s: started HW timer\n", __func__);
-    } else {
-        timeout_t *iter = head;
-        while(iter->next != NULL) {
-            iter = iter->next;
-        }
-        iter->next = new;
-        printf("%s: queued seqnum:%d\n", __func__, seqnum);
-    }
+/**
+* Function to count the seqnums from one to another, modulo the sequence space
+*
+* @param to later sequence number
+* @param from earlier sequence number
+*/
+static int seq_diff(int to, int from) {
+    return ((unsigned)to - (unsigned)from) & seqmask;
 }
 
 /**
-* Function to stop the timer for a packet with seqnum
+* Function to set timer for a packet with seqnum
+*
+* The timer id is the slot of the packet in the window, not its seqnum, so
+* the simulator keeps no more timers than the window has packets.
 *
-* @param seqnum sequence number of the packet
+* @param seqnum sequence number of the packet, unique in the window
 */
-void stop_timer(int seqnum) {
+static void start_timer(int seqnum) {
     printf("%s: seqnum:%d\n", __func__, seqnum);
-    if (head != NULL) {
-        if (head->seqnum == seqnum) {
-            // stop the HW timer
-            stoptimer(0);
-            printf("%s: stopped HW timer\n", __func__);
-
-            // remove from queue
-            timeout_t *front = head;
-            head = head->next;
-            printf("%s: dequeued seqnum %d\n", __func__, seqnum);
-
-            if (head != NULL) {
-                // start the timer for the next seqnum in the queue
-                starttimer(0, TIMEOUT + head->start_time - get_sim_time());
-                printf("%s: started HW timer\n", __func__);
-            }
-
-            free(front);
-        } else {
-            // search and remove from the queue
-            timeout_t *iter = head;
-            while (iter->next != NULL) {
-                if (iter->next->seqnum == seqnum) {
-                    timeout_t *temp = iter->next;
-                    iter->next = temp->next;
-                    printf("%s: dequeued seqnum %d\n", __func__, seqnum);
-                    free(temp);
-                    break;
-                }
-                iter = iter->next;
-            }
-        }
-    } else {
-        printf("%s: timer queue was empty\n", __func__);
-    }
+    starttimer_id(0, seqnum & (st->sndpkt_size - 1), TIMEOUT);
 }
 
 /**
 * Function to determine the least unacked packet seqnum
 */
 int get_next_unacked() {
-    int min = INT_MAX;
-    timeout_t *iter = head;
-    while(iter != NULL) {
-        if (iter->seqnum < min) {
-            min = iter->seqnum;
+    int i;
+
+    for (i = st->base_a; i != st->nextseqnum; i = seq_add(i, 1)) {
+        if (!st->acked[i & (st->sndpkt_size - 1)]) {
+            break;
         }
-        iter = iter->next;
-    }
-    if (min != INT_MAX) {
-        return min;
     }
-    return end_a + 1;
+    return i;
 }
 
 /**
@@ -171,58 +137,150 @@ static int corrupt(struct pkt *packet) {
     return 0;
 }
 
+/**
+* Function to put a message at the end of the backlog
+*
+* @param message message that does not fit in the window
+*/
+static void backlog_push(struct msg *message) {
+    int i;
+
+    if (st->backlog_count == st->backlog_size) {
+        // grow, with the oldest message first again
+        struct msg *backlog = malloc(2 * st->backlog_size * sizeof(struct msg));
+        for (i = 0; i < st->backlog_count; ++i) {
+            backlog[i] = st->backlog[(st->backlog_head + i) % st->backlog_size];
+        }
+        free(st->backlog);
+        st->backlog = backlog;
+        st->backlog_head = 0;
+        st->backlog_size *= 2;
+    }
+    st->backlog[(st->backlog_head + st->backlog_count++) % st->backlog_size] = *message;
+}
+
+/**
+* Function to take the oldest message off the backlog
+*/
+static struct msg *backlog_pop() {
+    struct msg *message = &st->backlog[st->backlog_head];
+
+    st->backlog_head = (st->backlog_head + 1) % st->backlog_size;
+    --st->backlog_count;
+    return message;
+}
+
+/**
+* Function to make the packet of a message with the next seqnum, in the window
+*
+* @param message data of the packet
+* @return the packet
+*/
+static struct pkt *make_packet(struct msg *message) {
+    int i = st->nextseqnum & (st->sndpkt_size - 1);
+    struct pkt *packet = &st->sndpkt[i];
+
+    memset(packet, 0, sizeof(struct pkt));
+    packet->seqnum = st->nextseqnum;
+    memcpy(packet->payload, message->data, PAYLOAD_SIZE);
+    packet->checksum = checksum(packet);
+    st->acked[i] = 0;
+    st->nextseqnum = seq_add(st->nextseqnum, 1);
+    return packet;
+}
+
+/**
+* Function to size a buffer of the window as a power of 2, so that seqnum
+* modulo its size is the same on both sides of a wraparound
+*
+* @param winsize window size
+*/
+static int window_buffer_size(int winsize) {
+    int size = 1;
+
+    while (size < winsize) {
+        size *= 2;
+    }
+    return size;
+}
+
+/**
+* Function to set up the sequence space, getseqbits() bits wide
+*/
+static void init_seqnums() {
+    int bits = getseqbits();
+
+    seqmask = (1u << bits) - 1;
+    // B must tell a packet of its window from a resent one of the window
+    // before, so the two windows have to fit in the sequence space
+    if ((unsigned)getwinsize() > (seqmask >> 1) + 1) {
+        fprintf(stderr, "sr needs a window of at most 2^%d with %d-bit seqnums\n", bits - 1, bits);
+        exit(-1);
+    }
+}
+
 /* called from layer 5, passed the data to be sent to other side */
 void A_output(message)
   struct msg message;
 {
-    // create packet
-    memset(&sndpkt[nextseqnum], 0, sizeof(struct pkt));
-    sndpkt[nextseqnum].seqnum = nextseqnum;
-    memcpy(&sndpkt[nextseqnum].payload, &message.data, PAYLOAD_SIZE);
-    sndpkt[nextseqnum].checksum = checksum(&sndpkt[nextseqnum]);
+    struct pkt *packet;
 
-    if (nextseqnum < (base_a + winsize_a)) {
-        // send packet
-        tolayer3(0, sndpkt[nextseqnum]);
-        printf("%s: sent %.20s base_a:%d seqnum:%d\n", __func__, message.data, base_a, nextseqnum);
+    select_flow();
+    if (st->backlog_count == 0 && seq_diff(st->nextseqnum, st->base_a) < st->winsize_a) {
+        // create and send packet
+        packet = make_packet(&message);
+        tolayer3(0, *packet);
+        printf("%s: sent %.20s base_a:%d seqnum:%d\n", __func__, message.data, st->base_a, packet->seqnum);
 
         // start the timer for this packet
-        start_timer(nextseqnum);
-
-        // set the last sent message seqnum
-        end_a = nextseqnum;
+        start_timer(packet->seqnum);
     } else {
-        // buffer message
-        printf("%s: message %.20s with seqnum %d buffered\n", __func__, message.data, nextseqnum);
+        // buffer message, it gets its seq num when it is sent
+        backlog_push(&message);
+        printf("%s: message %.20s with seqnum %d buffered\n", __func__, message.data,
+               seq_add(st->nextseqnum, st->backlog_count - 1));
     }
-
-    // increment seq num
-    ++nextseqnum;
 }
 
 /* called from layer 3, when a packet arrives for layer 4 */
 void A_input(packet)
   struct pkt packet;
 {
-    if (!corrupt(&packet) && packet.acknum >= base_a && packet.acknum < (base_a + winsize_a)) {
-        printf("%s: acknum:%d base_a:%d\n", __func__, packet.acknum, base_a);
-
-        // mark packet as received by stopping the timer
-        stop_timer(packet.acknum);
+    select_flow();
+    if (!corrupt(&packet) && seq_diff(packet.acknum, st->base_a) < seq_diff(st->nextseqnum, st->base_a)) {
+        printf("%s: acknum:%d base_a:%d\n", __func__, packet.acknum, st->base_a);
+
+        // mark packet as received by stopping its timer
+        if (!st->acked[packet.acknum & (st->sndpkt_size - 1)]) {
+            st->acked[packet.acknum & (st->sndpkt_size - 1)] = 1;
+            stoptimer_id(0, packet.acknum & (st->sndpkt_size - 1));
+            printf("%s: stopped timer for seqnum:%d\n", __func__, packet.acknum);
+        }
 
         // if the ACK is for base_a then slide the window forward
-        if (base_a == packet.acknum) {
-            base_a = get_next_unacked();
-            printf("%s move base_a to %d\n",__func__, base_a);
-
-            // if there are buffered messages, send them
-            for (int i = end_a + 1; (i < nextseqnum && i < (base_a + winsize_a)); ++i) {
-                printf("sending buffered message %.20s with deq num %d", sndpkt[i].payload, sndpkt[i].seqnum);
-                tolayer3(0, sndpkt[i]);
-                end_a = i;
-
-                // start the timer for this packet
-                start_timer(end_a);
+        if (st->base_a == packet.acknum) {
+            st->base_a = get_next_unacked();
+            printf("%s move base_a to %d\n",__func__, st->base_a);
+
+            // if there are buffered messages, send them in one burst, in
+            // two if they wrap around the end of the buffer
+            int first = st->nextseqnum;
+            int n = 0;
+            while (st->backlog_count > 0 && seq_diff(st->nextseqnum, st->base_a) < st->winsize_a) {
+                make_packet(backlog_pop());
+                ++n;
+            }
+            if (n > 0) {
+                int i = first & (st->sndpkt_size - 1);
+                int k = n < st->sndpkt_size - i ? n : st->sndpkt_size - i;
+                printf("sending buffered messages with seq num %d to %d\n", first, seq_add(first, n - 1));
+                tolayer3_batch(0, &st->sndpkt[i], k);
+                tolayer3_batch(0, st->sndpkt, n - k);
+
+                // start the timers for these packets
+                for (i = 0; i < n; ++i) {
+                    start_timer(seq_add(first, i));
+                }
             }
         }
     } else {
@@ -230,66 +288,74 @@ void A_input(packet)
     }
 }
 
-/**
-* Callback function for the software timer interrupt
-*
-* @param seqnum seqnum corresponding to the timedout packet
-*/
-static void timeout_callback(int seqnum) {
-    printf("%s: seqnum:%d\n", __func__, seqnum);
+/* called when the timer of the packet in window slot goes off at A */
+void A_timerinterrupt_id(slot)
+  int slot;
+{
+    select_flow();
+    printf("%s: seqnum:%d\n", __func__, st->sndpkt[slot].seqnum);
 
     // resend the packet
-    tolayer3(0, sndpkt[seqnum]);
+    tolayer3(0, st->sndpkt[slot]);
 
     // restart the timer
-    start_timer(seqnum);
+    start_timer(st->sndpkt[slot].seqnum);
 }
 
-/* called when A's timer goes off */
+/* called when A's timer goes off, unused as every packet has a timer of its own */
 void A_timerinterrupt()
 {
-    // timeout happened for the seqnum in the front of the queue
-    if (head != NULL) {
-        // remove it and call the callback func
-        timeout_t *front = head;
-        timeout_callback(front->seqnum);
-        head = head->next;
-
-        // start the timer for the next seqnum in the queue
-        starttimer(0, head->start_time - front->start_time);
-        printf("%s: started HW timer\n", __func__);
-
-        free(front);
-    } else {
-        printf("%s: timer queue was empty", __func__);
-    }
 }  
 
 /* the following routine will be called once (only) before any other */
 /* entity A routines are called. You can use it to do any initialization */
 void A_init()
 {
+    select_flow();
+    init_seqnums();
+
     // get the window size
-    winsize_a = getwinsize();
+    st->winsize_a = getwinsize();
 
     // set the base and nextseqnum
-    base_a = 1;
-    nextseqnum = 1;
-
-    // allocate buffers
-    if (sndpkt == NULL) {
-        sndpkt = malloc(NUM_MSGS * sizeof(struct pkt));
+    st->base_a = 1;
+    st->nextseqnum = 1;
+
+    // allocate buffers, the size of the window
+    if (st->sndpkt == NULL) {
+        st->sndpkt_size = window_buffer_size(st->winsize_a);
+        st->sndpkt = malloc(st->sndpkt_size * sizeof(struct pkt));
+        st->acked = malloc(st->sndpkt_size);
+        st->backlog_size = BACKLOG_SIZE;
+        st->backlog = malloc(BACKLOG_SIZE * sizeof(struct msg));
     }
+    memset(st->acked, 0, st->sndpkt_size);
+    st->backlog_head = 0;
+    st->backlog_count = 0;
 }
 
 /* Note that with simplex transfer from a-to-B, there is no B_output() */
 
+/* report the window state to the simulator */
+void get_proto_stats(struct proto_stats *stats)
+{
+    select_flow();
+    stats->snd_base = st->base_a;
+    stats->snd_next = st->base_a + seq_diff(st->nextseqnum, st->base_a);
+    stats->snd_unsent = st->backlog_count;
+    stats->snd_window = st->winsize_a;
+    stats->rcv_buffered = st->nbuffered_b;
+}
+
 /* called from layer 3, when a packet arrives for layer 4 at B*/
 void B_input(packet)
   struct pkt packet;
 {
+    select_flow();
     if (!corrupt(&packet)) {
-        if (packet.seqnum >= base_b && packet.seqnum < (base_b + winsize_b)) {
+        int slot = packet.seqnum & (st->recv_size - 1);
+
+        if (seq_diff(packet.seqnum, st->base_b) < st->winsize_b) {
             printf("%s: packet in current window - seqnum %d\n", __func__, packet.seqnum);
 
             // create ACK
@@ -302,32 +368,25 @@ void B_input(packet)
             tolayer3(1, ackpkt);
             printf("%s: sent acknum %d\n", __func__, packet.seqnum);
 
-            if (!received[packet.seqnum]) {
-                // mark as received
-                received[packet.seqnum] = 1;
-
-                // buffer the packet
-                memcpy(&recvpkt[packet.seqnum], &packet, sizeof(struct pkt));
-
-                // mark for delivery
-                undelivered[packet.seqnum] = 1;
+            if (!st->buffered[slot]) {
+                // buffer the packet, marked for delivery
+                memcpy(&st->recvpkt[slot], &packet, sizeof(struct pkt));
+                st->buffered[slot] = 1;
+                ++st->nbuffered_b;
 
-                if (packet.seqnum == base_b) {
+                if (packet.seqnum == st->base_b) {
                     // in order packet
-                    int i;
-                    for (i = packet.seqnum; i < (base_b + winsize_b); ++i) {
-                        if (undelivered[i]) {
-                            printf("%s: delivered seqnum %d\n", __func__, recvpkt[i].seqnum);
-                            tolayer5(1, recvpkt[i].payload);
-                            undelivered[i] = 0;
-                        } else {
-                            break;
-                        }
+                    for (int n = 0; n < st->winsize_b && st->buffered[slot]; ++n) {
+                        printf("%s: delivered seqnum %d\n", __func__, st->recvpkt[slot].seqnum);
+                        tolayer5(1, st->recvpkt[slot].payload);
+                        st->buffered[slot] = 0;
+                        --st->nbuffered_b;
+                        st->base_b = seq_add(st->base_b, 1);
+                        slot = st->base_b & (st->recv_size - 1);
                     }
-                    base_b = i;
                 }
             }
-        } else if (packet.seqnum >= (base_b - winsize_b) && packet.seqnum < (base_b - 1)) {
+        } else if (seq_diff(st->base_b, packet.seqnum) >= 2 && seq_diff(st->base_b, packet.seqnum) <= st->winsize_b) {
             printf("%s: packet in previous window - seqnum %d\n", __func__, packet.seqnum);
 
             // create ACK
@@ -352,26 +411,73 @@ void B_input(packet)
 /* entity B routines are called. You can use it to do any initialization */
 void B_init()
 {
+    select_flow();
+    init_seqnums();
+
     // get the window size
-    winsize_b = getwinsize();
+    st->winsize_b = getwinsize();
 
     // set the base and expseqnum
-    base_b = 1;
-
-    // allocate buffers
-    if (recvpkt == NULL) {
-        recvpkt = malloc(NUM_MSGS * sizeof(struct pkt));
+    st->base_b = 1;
+    st->nbuffered_b = 0;
+
+    // allocate buffers, the size of the window
+    if (st->recvpkt == NULL) {
+        st->recv_size = window_buffer_size(st->winsize_b);
+        st->recvpkt = malloc(st->recv_size * sizeof(struct pkt));
+        st->buffered = malloc(st->recv_size);
     }
+    memset(st->buffered, 0, st->recv_size);
+}
+
+/* save the protocol state for a simulator snapshot */
+void proto_save()
+{
+    for (int f = 0; f < getnflows(); ++f) {
+        st = &flows[f];
+        snapshot_write(&st->base_a, sizeof(st->base_a));
+        snapshot_write(&st->nextseqnum, sizeof(st->nextseqnum));
+        snapshot_write(st->sndpkt, st->sndpkt_size * sizeof(struct pkt));
+
+        // the timers themselves are events saved by the simulator
+        snapshot_write(st->acked, st->sndpkt_size);
+        snapshot_write(&st->backlog_count, sizeof(st->backlog_count));
+        for (int i = 0; i < st->backlog_count; ++i) {
+            snapshot_write(&st->backlog[(st->backlog_head + i) % st->backlog_size], sizeof(struct msg));
+        }
 
-    // allocate memory for delivered flags
-    if (undelivered == NULL) {
-        undelivered = malloc(NUM_MSGS * sizeof(int));
+        snapshot_write(&st->base_b, sizeof(st->base_b));
+        snapshot_write(&st->nbuffered_b, sizeof(st->nbuffered_b));
+        snapshot_write(st->recvpkt, st->recv_size * sizeof(struct pkt));
+        snapshot_write(st->buffered, st->recv_size);
     }
-    memset(undelivered, 0, NUM_MSGS * sizeof(int));
+}
 
-    // allocate memory for received flags
-    if (received == NULL) {
-        received = malloc(NUM_MSGS * sizeof(int));
+/* restore the protocol state from a simulator snapshot */
+void proto_restore()
+{
+    for (int f = 0; f < getnflows(); ++f) {
+        struct msg message;
+        int n;
+
+        st = &flows[f];
+        snapshot_read(&st->base_a, sizeof(st->base_a));
+        snapshot_read(&st->nextseqnum, sizeof(st->nextseqnum));
+        snapshot_read(st->sndpkt, st->sndpkt_size * sizeof(struct pkt));
+        snapshot_read(st->acked, st->sndpkt_size);
+        snapshot_read(&n, sizeof(n));
+        st->backlog_head = st->backlog_count = 0;
+        for (int i = 0; i < n; ++i) {
+            snapshot_read(&message, sizeof(message));
+            backlog_push(&message);
+        }
+
+        snapshot_read(&st->base_b, sizeof(st->base_b));
+        snapshot_read(&st->nbuffered_b, sizeof(st->nbuffered_b));
+        snapshot_read(st->recvpkt, st->recv_size * sizeof(struct pkt));
+        snapshot_read(st->buffered, st->recv_size);
     }
-    memset(received, 0, NUM_MSGS * sizeof(int));
 }
+
+/* entry points for the simulator */
+PROTOCOL_NAMED_TIMERS(sr);
@@ -0,0 +1,267 @@
+#include "../include/traffic.h"
+#include "../include/event.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+* Traffic models of the layer 5 source.
+*
+* The gap before each message arrival comes from one of
+*   uniform         uniform on [0, 2 * mean], as the emulator always had
+*   poisson         exponential with the given mean
+*   saturated       the sender always has data: a message arrives whenever
+*                   A has nothing unsent and room in its window, as the
+*                   protocol reports in its stats, and the uniform ones
+*                   keep coming when it has not, so a stalled protocol
+*                   still reaches the end of the run
+*   onoff:ON,OFF    poisson arrivals during on periods, none during off
+*                   periods, both exponential with means ON and OFF
+*   trace:FILE      the gaps listed in FILE, in time units, over and over
+* Each flow draws from its own arrival stream and walks the trace on its
+* own. Flows start in an off period, so they do not all burst together.
+*
+* Message payloads are a letter per message (the default), random letters,
+* or a given text repeated. The last bytes always carry the tag of the
+* message, see metrics.c. Nothing is allocated per message.
+*/
+
+#define TRAFFIC_UNIFORM   0
+#define TRAFFIC_POISSON   1
+#define TRAFFIC_SATURATED 2
+#define TRAFFIC_ONOFF     3
+#define TRAFFIC_TRACE     4
+
+#define PAYLOAD_LETTERS 0
+#define PAYLOAD_RANDOM  1
+#define PAYLOAD_TEXT    2
+
+#define PAYLOAD_SIZE 20
+
+static int model = TRAFFIC_UNIFORM;
+static double onmean = 100.0;
+static double offmean = 100.0;
+static double *gaps = NULL;
+static int ngaps;
+static const char *tracefile;
+
+static int content = PAYLOAD_LETTERS;
+static char text[PAYLOAD_SIZE];
+
+/**
+* Function to read the gaps of an arrival trace
+*
+* @param filename text file of gaps in time units
+* @return 0 on success, -1 on error
+*/
+static int load_trace(const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    int size = 0;
+    double gap;
+
+    if (fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+    ngaps = 0;
+    while (fscanf(fp, "%lf", &gap) == 1) {
+        if (gap < 0.0) {
+            fprintf(stderr, "Negative gap in trace %s\n", filename);
+            fclose(fp);
+            return -1;
+        }
+        if (ngaps == size) {
+            size = size ? 2 * size : 64;
+            gaps = realloc(gaps, size * sizeof(double));
+        }
+        gaps[ngaps++] = gap;
+    }
+    if (!feof(fp) || ngaps == 0) {
+        fprintf(stderr, "Trace %s is not a list of gaps\n", filename);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/**
+* Function to select the arrival model
+*
+* @param spec uniform, poisson, saturated, onoff[:ON,OFF] or trace:FILE
+* @return 0 on success, -1 on error
+*/
+int traffic_open(const char *spec) {
+    if (strcmp(spec, "uniform") == 0) {
+        model = TRAFFIC_UNIFORM;
+    } else if (strcmp(spec, "poisson") == 0) {
+        model = TRAFFIC_POISSON;
+    } else if (strcmp(spec, "saturated") == 0) {
+        model = TRAFFIC_SATURATED;
+    } else if (strcmp(spec, "onoff") == 0) {
+        model = TRAFFIC_ONOFF;
+    } else if (strncmp(spec, "onoff:", 6) == 0) {
+        if (sscanf(spec + 6, "%lf,%lf", &onmean, &offmean) != 2 || onmean <= 0.0 || offmean < 0.0) {
+            fprintf(stderr, "Invalid value for --traffic=onoff:ON,OFF\n");
+            return -1;
+        }
+        model = TRAFFIC_ONOFF;
+    } else if (strncmp(spec, "trace:", 6) == 0) {
+        if (load_trace(spec + 6) < 0) {
+            return -1;
+        }
+        tracefile = spec + 6;
+        model = TRAFFIC_TRACE;
+    } else {
+        fprintf(stderr, "Invalid value for --traffic\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+* Function to select the payload of the messages
+*
+* @param spec letters, random, or a text to repeat
+* @return 0 on success, -1 on error
+*/
+int payload_open(const char *spec) {
+    if (strcmp(spec, "letters") == 0) {
+        content = PAYLOAD_LETTERS;
+    } else if (strcmp(spec, "random") == 0) {
+        content = PAYLOAD_RANDOM;
+    } else if (*spec != '\0') {
+        content = PAYLOAD_TEXT;
+        for (int i = 0; i < PAYLOAD_SIZE; ++i) {
+            text[i] = spec[i % strlen(spec)];
+        }
+    } else {
+        fprintf(stderr, "Invalid value for --payload\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+* Function to write the arrival model and the payload as parsed, one per
+* line, so that the same configuration always reads the same
+*
+* @param fp where to write them
+*/
+void traffic_describe(FILE *fp) {
+    switch (model) {
+    case TRAFFIC_UNIFORM:
+        fprintf(fp, "traffic uniform\n");
+        break;
+    case TRAFFIC_POISSON:
+        fprintf(fp, "traffic poisson\n");
+        break;
+    case TRAFFIC_SATURATED:
+        fprintf(fp, "traffic saturated\n");
+        break;
+    case TRAFFIC_ONOFF:
+        fprintf(fp, "traffic onoff %.17g,%.17g\n", onmean, offmean);
+        break;
+    case TRAFFIC_TRACE:
+        fprintf(fp, "traffic trace:%s\n", tracefile);
+        break;
+    }
+    if (content == PAYLOAD_TEXT) {
+        fprintf(fp, "payload %.*s\n", PAYLOAD_SIZE, text);
+    } else {
+        fprintf(fp, "payload %s\n", content == PAYLOAD_RANDOM ? "random" : "letters");
+    }
+}
+
+/**
+* Function to draw an exponential time from the arrival stream
+*
+* @param mean mean time
+*/
+static double exponential(double mean) {
+    double u = simrand(RNG_ARRIVALS);
+
+    // a single flow draws from jimsrand(), which rounds up to 1 at times,
+    // and the log of 0 would make the gap infinite
+    if (u >= 1.0) {
+        u = 1.0 - 1.0 / 16777216.0;
+    }
+    return -mean * log(1.0 - u);
+}
+
+/**
+* Function to draw the gap before the next message of the current flow
+*
+* @param mean mean gap (-t)
+* @return gap in time units
+*/
+double traffic_gap(double mean) {
+    struct flow *fl = &flows[curflow];
+    double gap, off = 0.0;
+
+    switch (model) {
+    case TRAFFIC_POISSON:
+        return exponential(mean);
+    case TRAFFIC_ONOFF:
+        // skip off periods until a gap ends within an on period
+        for (;;) {
+            gap = exponential(mean);
+            if (gap <= fl->onleft) {
+                fl->onleft -= gap;
+                return off + gap;
+            }
+            off += fl->onleft + exponential(offmean);
+            fl->onleft = exponential(onmean);
+        }
+    case TRAFFIC_TRACE:
+        gap = gaps[fl->traceidx];
+        fl->traceidx = (fl->traceidx + 1) % ngaps;
+        return gap;
+    default:
+        // in float, as it has always been drawn
+        return (float)mean * simrand(RNG_ARRIVALS) * 2;
+    }
+}
+
+/**
+* Function to tell if a saturated source owes the current flow a message
+*
+* @return 1 if a message should arrive now
+*/
+int traffic_due() {
+    struct proto_stats stats;
+
+    if (model != TRAFFIC_SATURATED) {
+        return 0;
+    }
+    proto->get_stats(&stats);
+    return stats.snd_unsent == 0 && stats.snd_next - stats.snd_base < stats.snd_window;
+}
+
+/**
+* Function to fill in the payload of a new message
+*
+* @param message message to fill
+* @param nsim messages of the flow so far
+* @param id message number, see metrics_tag()
+*/
+void traffic_fill(struct msg *message, int nsim, int id) {
+    unsigned long long z, r;
+
+    if (content == PAYLOAD_TEXT) {
+        memcpy(message->data, text, PAYLOAD_SIZE);
+    } else if (content == PAYLOAD_RANDOM) {
+        // from the id, so the random streams of the flow are left alone
+        z = (unsigned long long)id << 32;
+        for (int i = 0; i < PAYLOAD_SIZE; ++i) {
+            r = (z += 0x9e3779b97f4a7c15ULL);
+            r = (r ^ (r >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            r = (r ^ (r >> 27)) * 0x94d049bb133111ebULL;
+            r ^= r >> 31;
+            message->data[i] = 'a' + (r >> 32) % 26;
+        }
+    } else {
+        memset(message->data, 'a' + nsim % 26, PAYLOAD_SIZE);
+    }
+}
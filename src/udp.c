@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+#include "../include/udp.h"
+#include "../include/event.h"
+#include "../include/wallclock.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+* Loopback UDP backend.
+*
+* A, B and the medium each get a thread and a UDP socket on 127.0.0.1.
+* A and B only talk to the medium, a proxy that puts every datagram
+* through sendpacket(): the bottleneck link, loss, delay, reordering and
+* corruption of the simulated medium, with the same options. The proxy
+* holds each datagram until its arrival time and then sends it on to the
+* other side.
+*
+* Time is the wall clock, timeunit microseconds to a time unit. Each
+* thread keeps its message arrivals, timers or held datagrams in an event
+* queue of its own, and sleeps in poll() on its socket and a timerfd armed
+* for the earliest of them. Datagrams are read and written in batches with
+* recvmmsg() and sendmmsg().
+*
+* The counters and metrics of the simulator are shared, so the threads run
+* the protocol callbacks and the medium under one lock, and do their
+* system calls outside it. Packets handed to layer 3 wait in the thread
+* until the lock is released.
+*/
+
+#define UDP_BATCH 64       /* datagrams per sendmmsg() or recvmmsg() */
+#define UDP_RCVBUF (1 << 20)
+#define PROXY 2            /* the medium, after A and B */
+
+/* what goes over the sockets */
+struct datagram {
+    int flow;
+    int from;              /* sending entity */
+    struct pkt packet;
+};
+
+struct endpoint {
+    pthread_t thread;
+    int sock;
+    int timer;             /* timerfd of the earliest event on the queue */
+    sim_ticks_t armed;     /* time it is armed for, -1 if disarmed */
+    struct sockaddr_in addr;
+    struct evqueue queue;
+    struct datagram *out;  /* datagrams to send once the lock is released */
+    int nout;
+    int outsize;
+    long nsent;            /* datagrams and system calls, for the report */
+    long nsendcalls;
+    long nreceived;
+    long nrecvcalls;
+    long nwakeups;
+};
+
+static struct endpoint endpoints[3];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int stopfd;                   /* eventfd, readable once the run is over */
+static int stopping;
+static int nflowsdone;
+static double wallsecs, cpusecs;
+
+/* the endpoint the calling thread is, NULL in the main thread */
+static __thread struct endpoint *self = NULL;
+
+/**
+* Function to arm the timerfd of the calling thread for its earliest event
+*/
+static void armtimer() {
+    struct event *e = nextevent();
+    sim_ticks_t when = e != NULL ? e->evtime : -1;
+
+    if (when == self->armed) {
+        return;
+    }
+    wallclock_arm(self->timer, when);
+    self->armed = when;
+}
+
+/**
+* Function to queue packets handed to layer 3 by an endpoint thread
+*
+* @param AorB sending entity
+* @param pkts packets to send, in order
+* @param n number of packets
+* @return 1 if queued, 0 if the caller is not an endpoint thread
+*/
+int udp_send(int AorB, const struct pkt *pkts, int n) {
+    struct datagram *d;
+
+    if (self == NULL) {
+        return 0;
+    }
+    if (self->nout + n > self->outsize) {
+        while (self->nout + n > self->outsize) {
+            self->outsize = self->outsize ? 2 * self->outsize : UDP_BATCH;
+        }
+        self->out = realloc(self->out, self->outsize * sizeof(struct datagram));
+    }
+    for (int i = 0; i < n; ++i) {
+        d = &self->out[self->nout++];
+        d->flow = curflow;
+        d->from = AorB;
+        d->packet = pkts[i];
+    }
+    return 1;
+}
+
+/**
+* Function to send the queued datagrams of the calling thread, in batches
+*/
+static void flush() {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct endpoint *to;
+    int i, n, sent;
+
+    for (sent = 0; sent < self->nout; sent += n) {
+        n = self->nout - sent < UDP_BATCH ? self->nout - sent : UDP_BATCH;
+        memset(msgs, 0, n * sizeof(struct mmsghdr));
+        for (i = 0; i < n; ++i) {
+            // A and B send to the medium, the medium to the other side
+            to = self == &endpoints[PROXY] ? &endpoints[1 - self->out[sent + i].from] : &endpoints[PROXY];
+            iov[i].iov_base = &self->out[sent + i];
+            iov[i].iov_len = sizeof(struct datagram);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &to->addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(to->addr);
+        }
+        if ((n = sendmmsg(self->sock, msgs, n, 0)) < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            // the datagrams are lost, as the medium may lose any
+            perror("sendmmsg");
+            break;
+        }
+        self->nsendcalls++;
+        self->nsent += n;
+    }
+    self->nout = 0;
+}
+
+/**
+* Function to handle an event of an endpoint, and end the run with the
+* last flow
+*
+* @param e event, freed
+*/
+static void handle(struct event *e) {
+    uint64_t one = 1;
+
+    if (handleevent(e) && ++nflowsdone == nflows) {
+        stopping = 1;
+        if (write(stopfd, &one, sizeof(one)) < 0) {
+            perror("eventfd");
+        }
+    }
+}
+
+/**
+* Function to run what is due at A or B: its arrivals and timers, then
+* the packets just received
+*
+* @param in datagrams received
+* @param n number of datagrams
+* @param t current time
+*/
+static void endpoint_due(struct datagram *in, int n, sim_ticks_t t) {
+    struct event *e;
+
+    while (!stopping && (e = nextevent()) != NULL && e->evtime <= t) {
+        handle(removeevent());
+    }
+    for (int i = 0; i < n && !stopping; ++i) {
+        e = newevent();
+        e->evtime = t;
+        e->evtype = FROM_LAYER3;
+        e->eventity = self - endpoints;
+        e->flow = in[i].flow;
+        e->pkt = in[i].packet;
+        e->pktptr = &e->pkt;
+        e->timerid = -1;
+        e->seq = 0;
+        handle(e);
+    }
+}
+
+/**
+* Function to put the datagrams received by the medium through it, and
+* pass on those whose arrival time has come
+*
+* @param in datagrams received
+* @param n number of datagrams
+* @param t current time
+*/
+static void proxy_due(struct datagram *in, int n, sim_ticks_t t) {
+    struct event *e;
+    struct pkt packet;
+    int from;
+
+    simtime = t;
+    for (int i = 0; i < n; ++i) {
+        curflow = in[i].flow;
+        sendpacket(in[i].from, &in[i].packet, flows[curflow].nextseq++);
+    }
+    while ((e = nextevent()) != NULL && e->evtime <= t) {
+        e = removeevent();
+        curflow = e->flow;
+        packet = e->pkt;
+        from = 1 - e->eventity;
+        freeevent(e);
+        udp_send(from, &packet, 1);
+    }
+}
+
+/**
+* Function run by the thread of each endpoint
+*
+* @param arg its struct endpoint
+*/
+static void *run(void *arg) {
+    struct datagram in[UDP_BATCH];
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct pollfd fds[3];
+    uint64_t expirations;
+    sim_ticks_t t;
+    int i, k, n;
+
+    self = arg;
+    evq = &self->queue;
+    self->armed = -1;
+    // wake up on time rather than up to 50 us late
+    prctl(PR_SET_TIMERSLACK, 1);
+    fds[0].fd = self->sock;
+    fds[1].fd = self->timer;
+    fds[2].fd = stopfd;
+    for (i = 0; i < 3; ++i) {
+        fds[i].events = POLLIN;
+    }
+
+    for (;;) {
+        armtimer();
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (fds[2].revents) {
+            break;
+        }
+        self->nwakeups++;
+        if (fds[1].revents && read(self->timer, &expirations, sizeof(expirations)) > 0) {
+            self->armed = -1;
+        }
+
+        n = 0;
+        if (fds[0].revents & POLLIN) {
+            memset(msgs, 0, sizeof(msgs));
+            for (i = 0; i < UDP_BATCH; ++i) {
+                iov[i].iov_base = &in[i];
+                iov[i].iov_len = sizeof(struct datagram);
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            if ((n = recvmmsg(self->sock, msgs, UDP_BATCH, MSG_DONTWAIT, NULL)) < 0) {
+                n = 0;
+            } else {
+                self->nrecvcalls++;
+                self->nreceived += n;
+            }
+            // drop what is not ours, keeping the rest in the order it came
+            for (i = k = 0; i < n; ++i) {
+                if (msgs[i].msg_len == sizeof(struct datagram) && in[i].flow >= 0 &&
+                    in[i].flow < nflows && (in[i].from == A || in[i].from == B)) {
+                    if (k != i) {
+                        in[k] = in[i];
+                    }
+                    k++;
+                }
+            }
+            n = k;
+        }
+
+        pthread_mutex_lock(&lock);
+        if (!stopping) {
+            t = wallclock_now();
+            if (self == &endpoints[PROXY]) {
+                proxy_due(in, n, t);
+            } else {
+                endpoint_due(in, n, t);
+            }
+        }
+        pthread_mutex_unlock(&lock);
+        flush();
+    }
+    return NULL;
+}
+
+/**
+* Function to open the socket and timer of an endpoint
+*
+* @param ep endpoint
+* @return 0 on success, -1 on error
+*/
+static int endpoint_open(struct endpoint *ep) {
+    socklen_t len = sizeof(ep->addr);
+    int size = UDP_RCVBUF;
+
+    memset(ep, 0, sizeof(*ep));
+    if ((ep->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    // packets the kernel drops are lost like any, but make it rare
+    setsockopt(ep->sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    ep->addr.sin_family = AF_INET;
+    ep->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ep->addr.sin_port = 0;
+    if (bind(ep->sock, (struct sockaddr *)&ep->addr, sizeof(ep->addr)) < 0 ||
+        getsockname(ep->sock, (struct sockaddr *)&ep->addr, &len) < 0) {
+        perror("bind");
+        close(ep->sock);
+        return -1;
+    }
+    if ((ep->timer = timerfd_create(CLOCK_MONOTONIC, 0)) < 0) {
+        perror("timerfd_create");
+        close(ep->sock);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+* Function to close an endpoint and free its events
+*
+* @param ep endpoint
+*/
+static void endpoint_close(struct endpoint *ep) {
+    struct event *e;
+
+    close(ep->sock);
+    close(ep->timer);
+    evq = &ep->queue;
+    while (evq->nevents > 0) {
+        freeevent(removeevent());
+    }
+    while ((e = evq->pool) != NULL) {
+        evq->pool = e->nextfree;
+        free(e);
+    }
+    free(evq->heap);
+    free(ep->out);
+    evq = &mainq;
+}
+
+/**
+* Function to run the simulation over loopback UDP, from the events on
+* the main queue
+*
+* @param timeunit wall-clock microseconds per time unit
+* @return 0 on success, -1 on error
+*/
+int udp_run(double timeunit) {
+    struct event *e;
+    int i, err;
+
+    for (i = 0; i < 3; ++i) {
+        if (endpoint_open(&endpoints[i]) < 0) {
+            while (i-- > 0) {
+                endpoint_close(&endpoints[i]);
+            }
+            return -1;
+        }
+    }
+    if ((stopfd = eventfd(0, 0)) < 0) {
+        perror("eventfd");
+        for (i = 0; i < 3; ++i) {
+            endpoint_close(&endpoints[i]);
+        }
+        return -1;
+    }
+
+    // the first arrivals and timers go to the entity they are for
+    while (mainq.nevents > 0) {
+        e = removeevent();
+        evq = &endpoints[e->eventity].queue;
+        if (e->evtype == FROM_LAYER3) {
+            evq->ninflight[e->eventity]++;
+        }
+        heapinsert(e);
+        evq = &mainq;
+    }
+
+    stopping = 0;
+    nflowsdone = 0;
+    wallclock_start(timeunit);
+    for (i = 0; i < 3; ++i) {
+        if ((err = pthread_create(&endpoints[i].thread, NULL, run, &endpoints[i])) != 0) {
+            fprintf(stderr, "Cannot start endpoint thread: %s\n", strerror(err));
+            exit(-1);
+        }
+    }
+    for (i = 0; i < 3; ++i) {
+        pthread_join(endpoints[i].thread, NULL);
+    }
+    wallclock_stop(&wallsecs, &cpusecs);
+
+    // the run ends when the last flow stops
+    simtime = 0;
+    for (i = 0; i < nflows; ++i) {
+        if (flows[i].stoptime > simtime) {
+            simtime = flows[i].stoptime;
+        }
+    }
+
+    for (i = 0; i < 3; ++i) {
+        endpoint_close(&endpoints[i]);
+    }
+    close(stopfd);
+    return 0;
+}
+
+/**
+* Function to report the I/O of the last run over UDP
+*
+* @param ndelivered messages delivered to layer 5
+*/
+void udp_printstats(int ndelivered) {
+    long nsent = 0, nsendcalls = 0, nreceived = 0, nrecvcalls = 0, nwakeups = 0;
+
+    for (int i = 0; i < 3; ++i) {
+        nsent += endpoints[i].nsent;
+        nsendcalls += endpoints[i].nsendcalls;
+        nreceived += endpoints[i].nreceived;
+        nrecvcalls += endpoints[i].nrecvcalls;
+        nwakeups += endpoints[i].nwakeups;
+    }
+    printf(" UDP: %ld datagrams sent in %ld sendmmsg calls, %ld received in %ld recvmmsg calls\n",
+           nsent, nsendcalls, nreceived, nrecvcalls);
+    printf(" UDP: %ld wakeups, %f s wall clock, %f s CPU", nwakeups, wallsecs, cpusecs);
+    if (ndelivered > 0) {
+        printf(", %f us CPU per delivered message", cpusecs * 1e6 / ndelivered);
+    }
+    printf("\n");
+}
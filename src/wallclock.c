@@ -0,0 +1,100 @@
+#include "../include/wallclock.h"
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+/**
+* Wall-clock time.
+*
+* The backends that run in real time map the simulated time onto the
+* monotonic clock, timeunit microseconds to a time unit from the start of
+* the run, and report the wall-clock and CPU time the run took. One run
+* goes at a time, so the clock is kept here for all of them.
+*/
+
+static double nsperunit;            /* wall-clock ns per time unit */
+static struct timespec start;
+static double cpustart;
+
+/**
+* Function to read a clock in seconds
+*/
+static double seconds(struct timespec *ts) {
+    return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+/**
+* Function to read the CPU time of the process in seconds
+*/
+static double cputime() {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+* Function to start the clock of a run at time 0
+*
+* @param timeunit wall-clock microseconds per time unit
+*/
+void wallclock_start(double timeunit) {
+    nsperunit = timeunit * 1000.0;
+    cpustart = cputime();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+/**
+* Function to read the wall clock in ticks since the start of the run
+*/
+sim_ticks_t wallclock_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (sim_ticks_t)((seconds(&ts) - seconds(&start)) * 1e9 * TICKS_PER_UNIT / nsperunit);
+}
+
+/**
+* Function to arm a timerfd for a simulated time
+*
+* @param timerfd timerfd on CLOCK_MONOTONIC
+* @param when time in ticks, -1 to disarm it
+*/
+void wallclock_arm(int timerfd, sim_ticks_t when) {
+    struct itimerspec its;
+    long long ns;
+
+    memset(&its, 0, sizeof(its));
+    if (when >= 0) {
+        ns = start.tv_nsec + (long long)((double)when * nsperunit / TICKS_PER_UNIT);
+        its.it_value.tv_sec = start.tv_sec + ns / 1000000000;
+        its.it_value.tv_nsec = ns % 1000000000;
+    }
+    timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/**
+* Function to read the time the run took
+*
+* @param wallsecs where to put the wall-clock seconds since the start
+* @param cpusecs where to put the CPU seconds of the process since then
+*/
+void wallclock_stop(double *wallsecs, double *cpusecs) {
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *wallsecs = seconds(&end) - seconds(&start);
+    *cpusecs = cputime() - cpustart;
+}
+
+/**
+* Function to read the CPU time of the calling thread in seconds
+*/
+double wallclock_threadcpu() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return seconds(&ts);
+}